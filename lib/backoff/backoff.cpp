@@ -0,0 +1,63 @@
+#include "backoff.h"
+
+Backoff::Backoff(uint32_t minDelay, uint32_t maxDelay, uint32_t salt)
+    : _minDelay(minDelay), _maxDelay(maxDelay), _delay(minDelay),
+      _random(deviceSeed() ^ salt) {
+  if (!_random) {
+    _random = 1;
+  }
+}
+
+uint32_t Backoff::deviceSeed() {
+  uint64_t mac = ESP.getEfuseMac();
+  return (uint32_t)mac ^ (uint32_t)(mac >> 32);
+}
+
+uint32_t Backoff::nextRandom() {
+  // xorshift32, deterministic per device but different across the fleet
+  _random ^= _random << 13;
+  _random ^= _random >> 17;
+  _random ^= _random << 5;
+  return _random;
+}
+
+void Backoff::schedule(uint32_t now) {
+  // equal jitter: half of the delay is fixed, the other half is random
+  uint32_t half = _delay / 2;
+  _nextAttempt = now + half + nextRandom() % (half + 1);
+  _delay = min(_delay * 2, _maxDelay);
+}
+
+bool Backoff::shouldAttempt(uint32_t now) {
+  if (!_waiting) {
+    // first failure, even the first retry is spread over the fleet
+    _waiting = true;
+    _triggered++;
+    schedule(now);
+    return false;
+  }
+
+  if ((int32_t)(now - _nextAttempt) < 0) {
+    return false;
+  }
+
+  _attempts++;
+  schedule(now);
+  return true;
+}
+
+void Backoff::reset() {
+  _delay = _minDelay;
+  _waiting = false;
+}
+
+uint32_t Backoff::spread(uint32_t period) {
+  return period ? nextRandom() % period : 0;
+}
+
+void Backoff::appendStatus(JsonVariant doc) const {
+  doc["attempts"] = _attempts;
+  doc["backoffs"] = _triggered;
+  doc["nextAttemptIn"] =
+      _waiting ? max<int32_t>(0, _nextAttempt - millis()) : 0;
+}
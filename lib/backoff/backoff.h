@@ -0,0 +1,29 @@
+#ifndef _BACKOFF_H_
+#define _BACKOFF_H_
+
+#include <ArduinoJson.h>
+
+class Backoff {
+  uint32_t _minDelay, _maxDelay;
+  uint32_t _delay;
+  uint32_t _nextAttempt = 0;
+  uint32_t _random;
+  uint32_t _attempts = 0;
+  uint32_t _triggered = 0;
+  bool _waiting = false;
+
+  uint32_t nextRandom();
+  void schedule(uint32_t now);
+
+public:
+  Backoff(uint32_t minDelay, uint32_t maxDelay, uint32_t salt);
+
+  bool shouldAttempt(uint32_t now);
+  void reset();
+  uint32_t spread(uint32_t period);
+  void appendStatus(JsonVariant doc) const;
+
+  static uint32_t deviceSeed();
+};
+
+#endif
@@ -0,0 +1,33 @@
+#include "boot-timeline.h"
+#include <Arduino.h>
+#include <esp_timer.h>
+
+static const char *phaseNames[Boot_PhaseCount] = {
+    "configRead", "associated", "gotIp", "mqttConnected", "stateSynced",
+};
+
+uint32_t BootTimeline::_marks[Boot_PhaseCount] = {};
+
+void BootTimeline::mark(BootPhase phase) {
+  if (!_marks[phase]) {
+    // msec since reset, 0 is reserved for "not reached yet"
+    _marks[phase] = max<uint32_t>(1, esp_timer_get_time() / 1000);
+  }
+}
+
+bool BootTimeline::isComplete() {
+  for (uint8_t i = 0; i < Boot_PhaseCount; i++) {
+    if (!_marks[i]) {
+      return false;
+    }
+  }
+  return true;
+}
+
+void BootTimeline::appendTimeline(JsonVariant doc) {
+  for (uint8_t i = 0; i < Boot_PhaseCount; i++) {
+    if (_marks[i]) {
+      doc[phaseNames[i]] = _marks[i];
+    }
+  }
+}
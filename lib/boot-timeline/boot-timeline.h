@@ -0,0 +1,24 @@
+#ifndef _BOOT_TIMELINE_H_
+#define _BOOT_TIMELINE_H_
+
+#include <ArduinoJson.h>
+
+enum BootPhase {
+  Boot_ConfigRead = 0,
+  Boot_Associated,
+  Boot_GotIp,
+  Boot_MqttConnected,
+  Boot_StateSynced,
+  Boot_PhaseCount,
+};
+
+class BootTimeline {
+  static uint32_t _marks[Boot_PhaseCount];
+
+public:
+  static void mark(BootPhase phase);
+  static bool isComplete();
+  static void appendTimeline(JsonVariant doc);
+};
+
+#endif
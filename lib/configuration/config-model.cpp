@@ -0,0 +1,250 @@
+#include "config-model.h"
+
+#define MAX_GPIO 39
+
+namespace {
+
+class Reader {
+  String &_error;
+
+public:
+  Reader(String &error) : _error(error) {}
+
+  void fail(const char *path) {
+    if (!_error.length()) {
+      _error = String("invalid ") + path;
+    }
+  }
+
+  void pin(JsonVariantConst value, int8_t &out, const char *path) {
+    if (value.isNull()) {
+      return;
+    }
+    int pin = value | -2;
+    if (!value.is<int>() || pin < -1 || pin > MAX_GPIO) {
+      fail(path);
+      return;
+    }
+    out = pin;
+  }
+
+  template <typename T>
+  void number(JsonVariantConst value, T &out, const char *path, long min,
+              long max) {
+    if (value.isNull()) {
+      return;
+    }
+    long number = value | min - 1;
+    if (!value.is<long>() || number < min || number > max) {
+      fail(path);
+      return;
+    }
+    out = number;
+  }
+
+  void level(JsonVariantConst value, uint8_t &out, const char *path) {
+    number(value, out, path, 0, 255);
+  }
+
+  void levels(JsonVariantConst value, LedLevels &out, const char *path) {
+    level(value["blue"], out.blue, path);
+    level(value["touch"], out.touch, path);
+    level(value["red"], out.red, path);
+  }
+
+  void string(JsonVariantConst value, String &out) {
+    if (value.is<const char *>()) {
+      out = value.as<const char *>();
+    }
+  }
+
+  void flag(JsonVariantConst value, bool &out) {
+    if (value.is<bool>()) {
+      out = value.as<bool>();
+    }
+  }
+};
+
+void readBlindsMotor(Reader &read, JsonVariantConst json,
+                     BlindsMotorConfig &motor) {
+  read.pin(json["pins"]["open"], motor.open, "blinds.pins.open");
+  read.pin(json["pins"]["close"], motor.close, "blinds.pins.close");
+  read.number(json["travel"], motor.travel, "blinds.travel", MSEC(100),
+              MINS(10));
+  read.number(json["openCloseDelta"], motor.openCloseDelta,
+              "blinds.openCloseDelta", 0, MINS(1));
+  read.number(json["tilt"]["open"], motor.tiltOpen, "blinds.tilt.open",
+              MSEC(50), MSEC(1500));
+  read.number(json["tilt"]["close"], motor.tiltClose, "blinds.tilt.close",
+              MSEC(50), MSEC(1500));
+  if (!motor.tiltOpen != !motor.tiltClose) {
+    // turning the slats needs the time of both directions
+    motor.tiltOpen = motor.tiltClose = 0;
+    read.fail("blinds.tilt");
+  }
+
+  auto openCurve = json["curve"]["open"].as<JsonArrayConst>();
+  auto closeCurve = json["curve"]["close"].as<JsonArrayConst>();
+  if (openCurve.size() == CONFIG_TRAVEL_SEGMENTS &&
+      closeCurve.size() == CONFIG_TRAVEL_SEGMENTS) {
+    motor.hasCurve = true;
+    for (uint8_t i = 0; i < CONFIG_TRAVEL_SEGMENTS; i++) {
+      read.number(openCurve[i], motor.openCurve[i], "blinds.curve", MSEC(10),
+                  MINS(10));
+      read.number(closeCurve[i], motor.closeCurve[i], "blinds.curve",
+                  MSEC(10), MINS(10));
+    }
+  } else if (!json["curve"].isNull()) {
+    read.fail("blinds.curve");
+  }
+}
+
+} // namespace
+
+bool parseConfig(JsonVariantConst json, DeviceConfig &config, String &error) {
+  Reader read(error);
+  error = "";
+
+  read.string(json["type"], config.typeName);
+  if (config.typeName == "dimmer") {
+    config.type = Device_Dimmer;
+  } else if (config.typeName == "switch") {
+    config.type = Device_Switch;
+  } else if (config.typeName == "blinds") {
+    config.type = Device_Blinds;
+  }
+
+  auto mdns = json["mdns"];
+  read.flag(mdns["enabled"], config.mdns.enabled);
+  read.string(mdns["host"], config.mdns.host);
+
+  auto ota = json["ota"];
+  read.flag(ota["enabled"], config.ota.enabled);
+  read.number(ota["port"], config.ota.port, "ota.port", 1, 65535);
+  read.string(ota["password"], config.ota.password);
+
+  auto mqtt = json["mqtt"];
+  read.string(mqtt["host"], config.mqtt.host);
+  read.string(mqtt["user"], config.mqtt.user);
+  read.string(mqtt["password"], config.mqtt.password);
+  read.number(mqtt["port"], config.mqtt.port, "mqtt.port", 1, 65535);
+  read.string(mqtt["prefix"], config.mqtt.prefix);
+
+  auto wifi = json["wifi"];
+  read.string(wifi["ip"], config.wifi.ip);
+  read.string(wifi["gateway"], config.wifi.gateway);
+  read.string(wifi["subnet"], config.wifi.subnet);
+  read.string(wifi["dns"], config.wifi.dns);
+
+  auto pins = json["pins"];
+  for (uint8_t i = 0; i < CONFIG_CHANNELS; i++) {
+    read.pin(pins["led"][i], config.io.led[i], "pins.led");
+  }
+  read.pin(pins["redLed"], config.io.redLed, "pins.redLed");
+  read.flag(pins["redLedInvert"], config.io.redLedInvert);
+  if (!pins["qt"].isNull()) {
+    config.io.input = Input_Qt;
+    read.pin(pins["qt"]["sda"], config.io.qtSda, "pins.qt.sda");
+    read.pin(pins["qt"]["scl"], config.io.qtScl, "pins.qt.scl");
+    for (uint8_t i = 0; i < CONFIG_CHANNELS; i++) {
+      // qt channels are key numbers on the chip, not GPIOs
+      read.number(pins["qt"]["ch"][i], config.io.qtChannels[i], "pins.qt.ch",
+                  -1, 6);
+    }
+  } else if (!pins["input"].isNull()) {
+    config.io.input = Input_Pins;
+    for (uint8_t i = 0; i < CONFIG_CHANNELS; i++) {
+      read.pin(pins["input"][i], config.io.inputPins[i], "pins.input");
+    }
+  }
+  read.number(json["io"]["statusInterval"], config.io.statusInterval,
+              "io.statusInterval", MSEC(20), MINS(1));
+
+  auto group = json["group"];
+  read.string(group["name"], config.group.name);
+  read.string(group["address"], config.group.address);
+  read.number(group["port"], config.group.port, "group.port", 1, 65535);
+  read.number(group["repeat"], config.group.repeat, "group.repeat", 1, 5);
+
+  auto time = json["time"];
+  config.time.enabled = !time.isNull() || json["rules"].size();
+  read.string(time["server"], config.time.server);
+  read.string(time["tz"], config.time.tz);
+
+  auto power = json["power"];
+  read.number(power["maxFreq"], config.power.maxFreq, "power.maxFreq", 80,
+              240);
+  read.number(power["minFreq"], config.power.minFreq, "power.minFreq", 10,
+              config.power.maxFreq);
+  // the pll runs at 80, 160 or 240, below that the xtal is divided
+  if (config.power.maxFreq % 80 ||
+      (config.power.minFreq < 80 && 40 % config.power.minFreq) ||
+      (config.power.minFreq >= 80 && config.power.minFreq % 80)) {
+    read.fail("power.freq");
+  }
+  read.flag(power["lightSleep"], config.power.lightSleep);
+  read.flag(power["modemSleep"], config.power.modemSleep);
+  read.number(power["awakeFor"], config.power.awakeFor, "power.awakeFor", 0,
+              MINS(5));
+
+  auto dimmer = json["dimmer"];
+  read.pin(dimmer["pins"]["zero"], config.dimmer.zero, "dimmer.pins.zero");
+  read.pin(dimmer["pins"]["triac"], config.dimmer.triac, "dimmer.pins.triac");
+  auto curve = dimmer["curve"].as<JsonArrayConst>();
+  if (curve.size() == CONFIG_CURVE_POINTS) {
+    config.dimmer.hasCurve = true;
+    for (uint8_t i = 0; i < CONFIG_CURVE_POINTS; i++) {
+      read.number(curve[i], config.dimmer.curve[i], "dimmer.curve", 0, 10000);
+    }
+  } else if (!curve.isNull()) {
+    read.fail("dimmer.curve");
+  }
+  read.levels(dimmer["levels"]["on"], config.dimmer.on, "dimmer.levels.on");
+  read.levels(dimmer["levels"]["off"], config.dimmer.off, "dimmer.levels.off");
+
+  auto onOff = json["switch"];
+  for (uint8_t i = 0; i < CONFIG_CHANNELS; i++) {
+    read.pin(onOff["pins"][i], config.onOff.pins[i], "switch.pins");
+  }
+  read.level(onOff["levels"]["touch"], config.onOff.touchLevel,
+             "switch.levels.touch");
+  read.levels(onOff["levels"]["on"], config.onOff.on, "switch.levels.on");
+  read.levels(onOff["levels"]["off"], config.onOff.off, "switch.levels.off");
+  read.number(onOff["resetAfter"], config.onOff.resetAfter, "switch.resetAfter",
+              0, 65535);
+  auto zeroCross = onOff["zeroCross"];
+  read.pin(zeroCross["pin"], config.onOff.zero, "switch.zeroCross.pin");
+  for (uint8_t i = 0; i < CONFIG_CHANNELS; i++) {
+    read.number(zeroCross["operate"][i], config.onOff.operate[i],
+                "switch.zeroCross.operate", 0, 30000);
+  }
+  read.number(onOff["startGap"], config.onOff.startGap, "switch.startGap", 0,
+              SECS(5));
+
+  auto blinds = json["blinds"];
+  auto motors = blinds["motors"].as<JsonArrayConst>();
+  if (motors.size() > CONFIG_CHANNELS) {
+    read.fail("blinds.motors");
+  } else if (motors.size()) {
+    config.blinds.motorCount = motors.size();
+    for (uint8_t i = 0; i < motors.size(); i++) {
+      readBlindsMotor(read, motors[i], config.blinds.motors[i]);
+    }
+  } else {
+    readBlindsMotor(read, blinds, config.blinds.motors[0]);
+  }
+  read.number(blinds["delay"], config.blinds.delay, "blinds.delay", 0,
+              SECS(10));
+  read.level(blinds["levels"]["touch"], config.blinds.touchLevel,
+             "blinds.levels.touch");
+  read.level(blinds["levels"]["red"], config.blinds.redLevel,
+             "blinds.levels.red");
+  read.level(blinds["levels"]["changing"], config.blinds.changingLevel,
+             "blinds.levels.changing");
+  read.number(blinds["progressInterval"], config.blinds.progressInterval,
+              "blinds.progressInterval", 0, MINS(1));
+  read.number(blinds["startGap"], config.blinds.startGap, "blinds.startGap",
+              0, SECS(5));
+
+  return !error.length();
+}
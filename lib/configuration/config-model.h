@@ -0,0 +1,154 @@
+#ifndef _CONFIG_MODEL_H_
+#define _CONFIG_MODEL_H_
+
+#include "util.h"
+#include <Arduino.h>
+#include <ArduinoJson.h>
+
+#define CONFIG_CHANNELS 3
+#define CONFIG_CURVE_POINTS 100
+#define CONFIG_TRAVEL_SEGMENTS 4
+
+enum DeviceType {
+  Device_Undefined = 0,
+  Device_Dimmer,
+  Device_Switch,
+  Device_Blinds,
+};
+
+enum InputType { Input_None = 0, Input_Qt, Input_Pins };
+
+struct LedLevels {
+  uint8_t blue;
+  uint8_t touch;
+  uint8_t red;
+};
+
+struct MdnsConfig {
+  bool enabled = true;
+  String host;
+};
+
+struct OtaConfig {
+  bool enabled = true;
+  uint16_t port = 3232;
+  String password;
+};
+
+struct MqttConfig {
+  String host;
+  String user;
+  String password;
+  uint16_t port = 1883;
+  String prefix = "ha-switch";
+};
+
+struct WifiConfig {
+  String ip;
+  String gateway;
+  String subnet = "255.255.255.0";
+  String dns;
+};
+
+struct IoConfig {
+  int8_t led[CONFIG_CHANNELS] = {-1, -1, -1};
+  int8_t redLed = -1;
+  bool redLedInvert = false;
+  InputType input = Input_None;
+  int8_t qtSda = -1, qtScl = -1;
+  int8_t qtChannels[CONFIG_CHANNELS] = {-1, -1, -1};
+  int8_t inputPins[CONFIG_CHANNELS] = {-1, -1, -1};
+  uint32_t statusInterval = MSEC(250);
+};
+
+struct GroupConfig {
+  String name;
+  String address = "239.255.72.83";
+  uint16_t port = 7283;
+  uint8_t repeat = 2;
+};
+
+struct TimeConfig {
+  bool enabled = false;
+  String server = "pool.ntp.org";
+  String tz = "UTC0";
+};
+
+struct PowerConfig {
+  // cpu clock in MHz, scaled down to minFreq while nothing holds a lock
+  uint16_t maxFreq = 80, minFreq = 40;
+  bool lightSleep = false;
+  bool modemSleep = true;
+  // modem sleep stays off this long after a touch, command or request
+  uint32_t awakeFor = SECS(5);
+};
+
+struct DimmerConfig {
+  int8_t zero = -1, triac = -1;
+  bool hasCurve = false;
+  uint16_t curve[CONFIG_CURVE_POINTS];
+  LedLevels on = {20, 255, 0};
+  LedLevels off = {0, 255, 20};
+};
+
+struct SwitchConfig {
+  int8_t pins[CONFIG_CHANNELS] = {-1, -1, -1};
+  uint8_t touchLevel = 255;
+  LedLevels on = {20, 255, 0};
+  LedLevels off = {0, 255, 20};
+  uint16_t resetAfter = 0;
+  // relays switch at the mains zero crossing when the detector is wired
+  int8_t zero = -1;
+  // relay operate time in us, the coil is energized this much earlier. Set
+  // per relay from its datasheet or a scope, it is not measured at runtime
+  uint16_t operate[CONFIG_CHANNELS] = {0, 0, 0};
+  // spaces out relays turning on together, limits the combined inrush
+  uint16_t startGap = 0;
+};
+
+struct BlindsMotorConfig {
+  int8_t open = -1, close = -1;
+  uint32_t travel = SECS(40);
+  uint32_t openCloseDelta = MSEC(1500);
+  // venetian slat turn time per direction, 0 without tilt
+  uint16_t tiltOpen = 0, tiltClose = 0;
+  // calibrated travel time per segment, open end first
+  bool hasCurve = false;
+  uint32_t openCurve[CONFIG_TRAVEL_SEGMENTS];
+  uint32_t closeCurve[CONFIG_TRAVEL_SEGMENTS];
+};
+
+struct BlindsConfig {
+  // a single motor may be configured at the top level of blinds
+  uint8_t motorCount = 1;
+  BlindsMotorConfig motors[CONFIG_CHANNELS];
+  uint16_t delay = 500;
+  uint8_t touchLevel = 255, redLevel = 20, changingLevel = 80;
+  // position updates while moving, 0 only reports start and stop
+  uint32_t progressInterval = 0;
+  // spacing between motor starts, limits the supply inrush
+  uint16_t startGap = MSEC(300);
+};
+
+// the stored JSON config parsed once, defaults are the member initializers
+struct DeviceConfig {
+  DeviceType type = Device_Undefined;
+  String typeName = "undefined";
+  MdnsConfig mdns;
+  OtaConfig ota;
+  MqttConfig mqtt;
+  WifiConfig wifi;
+  IoConfig io;
+  GroupConfig group;
+  TimeConfig time;
+  PowerConfig power;
+  DimmerConfig dimmer;
+  SwitchConfig onOff;
+  BlindsConfig blinds;
+};
+
+// fills in the fields present in json, returns false and the first problem
+// when a value is out of range (the field keeps its default)
+bool parseConfig(JsonVariantConst json, DeviceConfig &config, String &error);
+
+#endif
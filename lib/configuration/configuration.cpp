@@ -1,21 +1,275 @@
 #include "configuration.h"
+#include "esp32/rom/crc.h"
+#include <memory>
+#include <vector>
 
-#define CONFIG_KEY "config"
+// one MessagePack blob per top level key. A changed key is written next to
+// its current blob, the index maps every key to its blob and is written
+// last, so it switches all changed keys at once.
+#define LEGACY_CONFIG_KEY "config"
+#define INDEX_KEY "index"
+#define MAX_NAME_LENGTH 13
+#define MAX_BLOB_SIZE 4000
 
-void Configuration::begin() { preferences.begin("ha-switch"); }
+namespace {
 
-JsonDocument *Configuration::read() {
-  if (!preferences.isKey(CONFIG_KEY)) {
-    return new JsonDocument();
+class CrcPrint : public Print {
+public:
+  uint32_t crc = 0;
+
+  size_t write(uint8_t c) override { return write(&c, 1); }
+  size_t write(const uint8_t *buffer, size_t size) override {
+    crc = crc32_le(crc, buffer, size);
+    return size;
+  }
+};
+
+// RFC 7386, null removes a member and objects merge recursively
+void mergePatch(JsonObject target, JsonObjectConst patch) {
+  for (JsonPairConst member : patch) {
+    const char *key = member.key().c_str();
+    JsonVariantConst value = member.value();
+
+    if (value.isNull()) {
+      target.remove(key);
+    } else if (value.is<JsonObjectConst>()) {
+      JsonObject child = target[key].is<JsonObject>()
+                             ? target[key].as<JsonObject>()
+                             : target[key].to<JsonObject>();
+      mergePatch(child, value);
+    } else {
+      target[key] = value;
+    }
+  }
+}
+
+String blobKey(uint8_t slot, const char *name) {
+  return String(slot ? "b." : "a.") + name;
+}
+
+bool sameMsgPack(JsonVariantConst a, JsonVariantConst b) {
+  size_t size = measureMsgPack(a);
+  if (a.isNull() || b.isNull() || size != measureMsgPack(b)) {
+    return false;
   }
+  std::unique_ptr<uint8_t[]> left(new uint8_t[size]);
+  std::unique_ptr<uint8_t[]> right(new uint8_t[size]);
+  serializeMsgPack(a, left.get(), size);
+  serializeMsgPack(b, right.get(), size);
+  return !memcmp(left.get(), right.get(), size);
+}
+
+} // namespace
 
-  auto json = preferences.getString(CONFIG_KEY);
-  JsonDocument *config = new JsonDocument();
-  deserializeJson(*config, json);
-  return config;
+void Configuration::begin() {
+  if (!_lock) {
+    _lock = xSemaphoreCreateRecursiveMutex();
+  }
+  ConfigurationLock scope(*this);
+  preferences.begin("ha-switch");
+
+  // configs written by older firmware are one JSON string
+  if (preferences.isKey(LEGACY_CONFIG_KEY)) {
+    JsonDocument doc;
+    deserializeJson(doc, preferences.getString(LEGACY_CONFIG_KEY));
+    if (replace(doc) == Config_Invalid) {
+      // keep running on it until a valid config is posted
+      _json = doc;
+      apply();
+      return;
+    }
+  }
+
+  load();
+  apply();
 }
 
-void Configuration::update(String json) {
-  // TODO: patch existing config
-  preferences.putString(CONFIG_KEY, json);
+void Configuration::load() {
+  _json.clear();
+  _json.to<JsonObject>();
+
+  auto readBlob = [this](const char *key, JsonDocument &doc) {
+    size_t size = preferences.getBytesLength(key);
+    if (!size || size > MAX_BLOB_SIZE) {
+      return false;
+    }
+    std::unique_ptr<uint8_t[]> buffer(new uint8_t[size]);
+    preferences.getBytes(key, buffer.get(), size);
+    return deserializeMsgPack(doc, buffer.get(), size) ==
+           DeserializationError::Code::Ok;
+  };
+
+  _index.clear();
+  if (!readBlob(INDEX_KEY, _index)) {
+    _index.to<JsonObject>();
+    return;
+  }
+
+  for (JsonPairConst entry : _index.as<JsonObjectConst>()) {
+    JsonDocument value;
+    String key = blobKey(entry.value(), entry.key().c_str());
+    if (readBlob(key.c_str(), value)) {
+      _json[entry.key().c_str()] = value;
+    }
+  }
+}
+
+void Configuration::apply() {
+  CrcPrint crc;
+  serializeMsgPack(_json, crc);
+  _etag = crc.crc;
+
+  // start from the defaults, fields missing in json must not keep their
+  // previous values
+  _config = DeviceConfig();
+  parseConfig(_json, _config, _error);
+  _generation++;
+}
+
+bool Configuration::putBlob(const char *key, JsonVariantConst value) {
+  size_t size = measureMsgPack(value);
+  std::unique_ptr<uint8_t[]> buffer(new uint8_t[size]);
+  serializeMsgPack(value, buffer.get(), size);
+  _nvsWrites++;
+  if (preferences.putBytes(key, buffer.get(), size) != size) {
+    // nvs full, the index must not point at it
+    _nvsErrors++;
+    return false;
+  }
+  return true;
+}
+
+ConfigUpdate Configuration::replace(JsonDocument &doc) {
+  if (!doc.is<JsonObject>()) {
+    return Config_Invalid;
+  }
+
+  // validate everything before the first write
+  for (JsonPairConst member : doc.as<JsonObjectConst>()) {
+    if (strlen(member.key().c_str()) > MAX_NAME_LENGTH ||
+        measureMsgPack(member.value()) > MAX_BLOB_SIZE) {
+      return Config_Invalid;
+    }
+  }
+
+  JsonDocument index;
+  auto slots = index.to<JsonObject>();
+  std::vector<String> written, replaced;
+  for (JsonPairConst member : doc.as<JsonObjectConst>()) {
+    const char *name = member.key().c_str();
+    JsonVariantConst slot = _index.as<JsonObjectConst>()[name];
+    JsonVariantConst stored = _json.as<JsonObjectConst>()[name];
+    if (slot.is<uint8_t>() && sameMsgPack(stored, member.value())) {
+      slots[name] = slot;
+      continue;
+    }
+
+    // the current blob stays valid until the index is switched
+    uint8_t next = slot.is<uint8_t>() ? !slot.as<uint8_t>() : 0;
+    written.push_back(blobKey(next, name));
+    if (!putBlob(written.back().c_str(), member.value())) {
+      break;
+    }
+    if (slot.is<uint8_t>()) {
+      replaced.push_back(blobKey(slot, name));
+    }
+    slots[name] = next;
+  }
+
+  for (JsonPairConst entry : _index.as<JsonObjectConst>()) {
+    if (doc[entry.key().c_str()].isNull()) {
+      replaced.push_back(blobKey(entry.value(), entry.key().c_str()));
+    }
+  }
+
+  bool isLegacy = preferences.isKey(LEGACY_CONFIG_KEY);
+  if (written.empty() && replaced.empty() && !isLegacy) {
+    return Config_Unchanged;
+  }
+
+  if (slots.size() != doc.size() || !putBlob(INDEX_KEY, index)) {
+    // the old index still points at the old blobs
+    for (String &key : written) {
+      preferences.remove(key.c_str());
+    }
+    return Config_Invalid;
+  }
+
+  for (String &key : replaced) {
+    preferences.remove(key.c_str());
+  }
+  if (isLegacy) {
+    preferences.remove(LEGACY_CONFIG_KEY);
+  }
+
+  _index = index;
+  _json = doc;
+  apply();
+  return Config_Changed;
+}
+
+void Configuration::lock() {
+  if (_lock) {
+    xSemaphoreTakeRecursive(_lock, portMAX_DELAY);
+  }
+}
+
+void Configuration::unlock() {
+  if (_lock) {
+    xSemaphoreGiveRecursive(_lock);
+  }
+}
+
+const DeviceConfig &Configuration::get() const { return _config; }
+
+JsonVariantConst Configuration::json() const { return _json; }
+
+uint32_t Configuration::generation() {
+  ConfigurationLock scope(*this);
+  return _generation;
+}
+
+uint32_t Configuration::etag() {
+  ConfigurationLock scope(*this);
+  return _etag;
+}
+
+void Configuration::write(Print &out) {
+  ConfigurationLock scope(*this);
+  serializeJson(_json, out);
+}
+
+ConfigUpdate Configuration::update(const char *json) {
+  JsonDocument doc;
+  if (deserializeJson(doc, json) != DeserializationError::Code::Ok) {
+    return Config_Invalid;
+  }
+  ConfigurationLock scope(*this);
+  return replace(doc);
+}
+
+ConfigUpdate Configuration::patch(const char *json) {
+  JsonDocument patch;
+  if (deserializeJson(patch, json) != DeserializationError::Code::Ok ||
+      !patch.is<JsonObject>()) {
+    return Config_Invalid;
+  }
+
+  ConfigurationLock scope(*this);
+  JsonDocument doc;
+  doc.set(_json);
+  mergePatch(doc.as<JsonObject>(), patch.as<JsonObjectConst>());
+  return replace(doc);
+}
+
+void Configuration::appendStatus(JsonVariant doc) {
+  ConfigurationLock scope(*this);
+  doc["generation"] = _generation;
+  doc["nvsWrites"] = _nvsWrites;
+  if (_nvsErrors) {
+    doc["nvsErrors"] = _nvsErrors;
+  }
+  if (_error.length()) {
+    doc["error"] = _error;
+  }
 }
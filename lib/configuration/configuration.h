@@ -1,17 +1,60 @@
 #ifndef _CONFIGURATION_H_
 #define _CONFIGURATION_H_
 
+#include "config-model.h"
 #include <ArduinoJson.h>
 #include <Preferences.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+
+enum ConfigUpdate { Config_Unchanged = 0, Config_Changed, Config_Invalid };
 
 class Configuration {
 private:
   Preferences preferences;
+  DeviceConfig _config;
+  // kept for the free-form parts of the config, like rules
+  JsonDocument _json;
+  String _error;
+  uint32_t _etag = 0;
+  uint32_t _generation = 0;
+  uint32_t _nvsWrites = 0;
+  uint32_t _nvsErrors = 0;
+  // the web server, the loop and the timers read and write the config
+  SemaphoreHandle_t _lock = nullptr;
+  // the stored keys and which of their two blobs is current
+  JsonDocument _index;
+
+  void load();
+  void apply();
+  ConfigUpdate replace(JsonDocument &doc);
+  bool putBlob(const char *key, JsonVariantConst value);
 
 public:
   void begin();
-  JsonDocument *read();
-  void update(String json);
+  void lock();
+  void unlock();
+  // only valid while a ConfigurationLock is held
+  const DeviceConfig &get() const;
+  JsonVariantConst json() const;
+  uint32_t generation();
+  uint32_t etag();
+  void write(Print &out);
+  ConfigUpdate update(const char *json);
+  ConfigUpdate patch(const char *json);
+  void appendStatus(JsonVariant doc);
+};
+
+// holds the configuration for as long as it is in scope
+class ConfigurationLock {
+  Configuration &_configuration;
+
+public:
+  ConfigurationLock(Configuration &configuration)
+      : _configuration(configuration) {
+    _configuration.lock();
+  }
+  ~ConfigurationLock() { _configuration.unlock(); }
 };
 
-#endif
\ No newline at end of file
+#endif
@@ -1,4 +1,7 @@
 #include "dimmer.h"
+#include "latency.h"
+#include "metrics.h"
+#include "util.h"
 
 #include "driver/gpio.h"
 #include "driver/rtc_io.h"
@@ -21,6 +24,7 @@ enum Labels {
   Label_SkipDelays,
   Label_ReloadDelayLow,
   Label_ReloadDelayHigh,
+  Label_Halt,
 };
 
 enum Registers {
@@ -31,9 +35,14 @@ enum Registers {
 
 enum Memory {
   Mem_Delay = 0,
+  Mem_Halt,
   Mem_Program,
 };
 
+// host asks the program to stop, the program acknowledges before halting
+#define HALT_REQUEST 1
+#define HALT_DONE 2
+
 #define TRIAC_OFF I_WR_REG(RTC_GPIO_OUT_REG, _triacIo, _triacIo, 0)
 #define TRIAC_ON I_WR_REG(RTC_GPIO_OUT_REG, _triacIo, _triacIo, 1)
 
@@ -42,6 +51,7 @@ enum Memory {
 #define TICKS 59247                   // number of delay ticks per 10msec
 #define TICKS_BEFORE_OFF (TICKS / 20) //.5 msec
 #define OFF_TICKS 0xFFFF
+#define HALT_TIMEOUT MSEC(100) // 5 mains periods
 
 enum DelayLabel {
   Label_Delay10k = 0,
@@ -152,16 +162,64 @@ void Dimmer::begin() {
       TRIAC_OFF,                                        // triac off
       I_LD(Reg_PulseDelay, Reg_DelayMemoryLocation, 0), // load the delay time from memory
       WAIT_FOR_HIGH(20),                                // wait until period ends
-      M_BX(Label_Start)                                 // ---- back to start ^
+      I_MOVI(Reg_Temp, Mem_Halt),                       // load halt location
+      I_LD(R0, Reg_Temp, 0),                            // load the halt request
+      M_BGE(Label_Halt, HALT_REQUEST),                  // stop when requested
+      M_BX(Label_Start),                                // ---- back to start ^
+      M_LABEL(Label_Halt),                              // ---- halt:
+      TRIAC_OFF,                                        // leave triac off
+      I_MOVI(R0, HALT_DONE),                            // acknowledge
+      I_ST(R0, Reg_Temp, 0),                            //
+      I_HALT()                                          // ---- done
   };
 
+  _lastTicks = OFF_TICKS;
   RTC_SLOW_MEM[Mem_Delay] = OFF_TICKS;
+  RTC_SLOW_MEM[Mem_Halt] = 0;
   size_t size = sizeof(program) / sizeof(ulp_insn_t);
   ulp_process_macros_and_load(Mem_Program, program, &size);
   ulp_run(Mem_Program);
+  _running = true;
+}
+
+bool Dimmer::end() {
+  if (!_running) {
+    return true;
+  }
+
+  // the tick writes the brightness into RTC memory, it must be done first
+  _ticker.detachAndWait();
+  ulp_timer_stop();
+  RTC_SLOW_MEM[Mem_Halt] = HALT_REQUEST;
+
+  // the program only looks at the request once per mains period and
+  // acknowledges it in RTC memory, the only way it can report back
+  auto start = millis();
+  while ((RTC_SLOW_MEM[Mem_Halt] & 0xFFFF) != HALT_DONE) {
+    if (millis() - start > HALT_TIMEOUT) {
+      // no zero cross, the program is stuck waiting and still owns the pins
+      _ticker.attach_ms(10, Dimmer::handle, this);
+      return false;
+    }
+    delay(1);
+  }
+
+  rtc_gpio_set_level((gpio_num_t)_pinTriac, 0);
+  rtc_gpio_deinit((gpio_num_t)_pinTriac);
+  rtc_gpio_pullup_dis((gpio_num_t)_pinZero);
+  rtc_gpio_deinit((gpio_num_t)_pinZero);
+  digitalWrite(_pinTriac, LOW);
+  _currentBrightness = 0;
+  _running = false;
+  return true;
+}
+
+bool Dimmer::hasPins(int8_t pinZero, int8_t pinTriac) const {
+  return _pinZero == pinZero && _pinTriac == pinTriac;
 }
 
 void Dimmer::handle(Dimmer *instance) {
+  MetricScope scope(Callback_Dimmer);
   Dimmer &dimmer = *instance;
   if (dimmer._minBrightnessUntil && millis() > dimmer._minBrightnessUntil) {
     dimmer._minBrightnessUntil = 0;
@@ -174,6 +232,7 @@ void Dimmer::handle(Dimmer *instance) {
                               : dimmer._minBrightness;
 
   if (dimmer._currentBrightness != targetBrightness) {
+    Metrics::count(Metric_DimmerSteps);
     if (dimmer._currentBrightness < targetBrightness)
       dimmer._currentBrightness++;
     else
@@ -184,11 +243,27 @@ void Dimmer::handle(Dimmer *instance) {
                                   dimmer._currentBrightness != targetBrightness
                               ? dimmer._curve[dimmer._currentBrightness - 1] * TICKS / 10000
                               : OFF_TICKS;
-  static uint16_t lastTicks = 0;
-
-  if (desiredTicks != lastTicks) {
-    lastTicks = desiredTicks;
+  if (desiredTicks != dimmer._lastTicks) {
+    dimmer._lastTicks = desiredTicks;
     RTC_SLOW_MEM[Mem_Delay] = desiredTicks;
+    CommandLatency::applied();
+  }
+
+  if (dimmer._currentBrightness == targetBrightness &&
+      !dimmer._minBrightnessUntil) {
+    dimmer._ticker.detach();
+    // a change may have raced the detach
+    auto target = dimmer._on ? max(dimmer._minBrightness, dimmer._brightness)
+                             : dimmer._minBrightness;
+    if (target != targetBrightness) {
+      dimmer.wake();
+    }
+  }
+}
+
+void Dimmer::wake() {
+  if (_running && !_ticker.active()) {
+    _ticker.attach_ms(10, Dimmer::handle, this);
   }
 }
 
@@ -212,6 +287,7 @@ void Dimmer::setBrightness(uint8_t brightness) {
   }
   if (_brightness != brightness) {
     _brightness = brightness;
+    wake();
     raiseStateChanged();
   }
 }
@@ -219,12 +295,15 @@ void Dimmer::setBrightness(uint8_t brightness) {
 void Dimmer::setOn(bool on) {
   if (_on != on) {
     _on = on;
+    wake();
     raiseStateChanged();
   }
 }
 
 void Dimmer::setBrightnessCurve(const uint16_t *curve) {
   memcpy(_curve, curve, 100 * sizeof(uint16_t));
+  // a settled dimmer has no tick left to write the new curve
+  wake();
 }
 
 void Dimmer::onStateChanged(DimmerStateChangedHandler handler) {
@@ -251,4 +330,5 @@ void Dimmer::setMinBrightnessFor(uint8_t brightness, uint16_t timeoutSec) {
     _minBrightness = 1;
     _minBrightnessUntil = 0;
   }
+  wake();
 }
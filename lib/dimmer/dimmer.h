@@ -1,8 +1,8 @@
 #ifndef _DIMMER_H_
 #define _DIMMER_H_
 
+#include "timers.h"
 #include <Arduino.h>
-#include <Ticker.h>
 
 typedef std::function<void(bool on, uint8_t brightness)>
     DimmerStateChangedHandler;
@@ -13,18 +13,25 @@ class Dimmer {
   uint8_t _currentBrightness = 0;
   uint8_t _minBrightness = 1;
   bool _on = false;
-  Ticker _ticker;
+  bool _running = false;
+  uint16_t _lastTicks = 0;
+  Timer _ticker{"dimmer"};
   static void handle(Dimmer *instance);
   uint16_t _curve[100];
   DimmerStateChangedHandler _handler;
   uint32_t _minBrightnessUntil = 0;
 
   void raiseStateChanged();
+  // restarts the fading ticks, they stop once the brightness has settled
+  void wake();
 
 public:
   Dimmer();
   bool usePins(int8_t pinZero, int8_t pinTriac);
   void begin();
+  // stops the ULP program and releases the pins, false if it did not stop
+  bool end();
+  bool hasPins(int8_t pinZero, int8_t pinTriac) const;
 
   uint8_t getBrightness() const;
   bool isOn() const;
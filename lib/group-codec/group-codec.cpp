@@ -0,0 +1,123 @@
+#include "group-codec.h"
+
+#define MAGIC_0 'H'
+#define MAGIC_1 'S'
+#define RESTART_WINDOW 64
+#define CRC_OFFSET (GROUP_PACKET_SIZE - 2)
+
+static void writeU16(uint8_t *buffer, uint16_t value) {
+  buffer[0] = value;
+  buffer[1] = value >> 8;
+}
+
+static void writeU32(uint8_t *buffer, uint32_t value) {
+  writeU16(buffer, value);
+  writeU16(buffer + 2, value >> 16);
+}
+
+static uint16_t readU16(const uint8_t *buffer) {
+  return buffer[0] | buffer[1] << 8;
+}
+
+static uint32_t readU32(const uint8_t *buffer) {
+  return readU16(buffer) | (uint32_t)readU16(buffer + 2) << 16;
+}
+
+uint16_t groupId(const char *name) {
+  // FNV-1a folded to 16 bits
+  uint32_t hash = 2166136261u;
+  while (*name) {
+    hash ^= (uint8_t)*name++;
+    hash *= 16777619u;
+  }
+  return (hash >> 16) ^ (hash & 0xFFFF);
+}
+
+uint16_t groupCrc(const uint8_t *buffer, size_t length) {
+  // CRC-16/CCITT-FALSE
+  uint16_t crc = 0xFFFF;
+  while (length--) {
+    crc ^= *buffer++ << 8;
+    for (uint8_t bit = 0; bit < 8; bit++) {
+      crc = crc & 0x8000 ? crc << 1 ^ 0x1021 : crc << 1;
+    }
+  }
+  return crc;
+}
+
+size_t encodeGroupMessage(const GroupMessage &message, uint8_t *buffer,
+                          size_t size) {
+  if (size < GROUP_PACKET_SIZE) {
+    return 0;
+  }
+
+  buffer[0] = MAGIC_0;
+  buffer[1] = MAGIC_1;
+  buffer[2] = GROUP_PROTOCOL_VERSION;
+  buffer[3] = message.type;
+  writeU16(buffer + 4, message.group);
+  writeU32(buffer + 6, message.sender);
+  writeU16(buffer + 10, message.sequence);
+
+  if (message.type == Group_Touch) {
+    buffer[12] = message.key;
+    buffer[13] = message.event;
+    buffer[14] = 0;
+    buffer[15] = 0;
+  } else {
+    buffer[12] = message.fields;
+    buffer[13] = message.on;
+    buffer[14] = message.brightness;
+    buffer[15] = message.openPercent;
+  }
+  writeU16(buffer + CRC_OFFSET, groupCrc(buffer, CRC_OFFSET));
+
+  return GROUP_PACKET_SIZE;
+}
+
+bool decodeGroupMessage(const uint8_t *buffer, size_t length,
+                        GroupMessage &message) {
+  if (length != GROUP_PACKET_SIZE || buffer[0] != MAGIC_0 ||
+      buffer[1] != MAGIC_1 || buffer[2] != GROUP_PROTOCOL_VERSION ||
+      readU16(buffer + CRC_OFFSET) != groupCrc(buffer, CRC_OFFSET)) {
+    return false;
+  }
+
+  message.type = buffer[3];
+  message.group = readU16(buffer + 4);
+  message.sender = readU32(buffer + 6);
+  message.sequence = readU16(buffer + 10);
+
+  if (message.type == Group_Touch) {
+    message.key = buffer[12];
+    message.event = buffer[13];
+    return message.event <= GroupTouch_Long;
+  } else if (message.type == Group_State) {
+    message.fields = buffer[12];
+    message.on = buffer[13];
+    message.brightness = buffer[14];
+    message.openPercent = buffer[15];
+    return true;
+  }
+
+  return false;
+}
+
+bool GroupSequenceFilter::accept(uint32_t sender, uint16_t sequence) {
+  for (uint8_t i = 0; i < GROUP_SENDERS; i++) {
+    if (_senders[i].id == sender) {
+      int16_t delta = sequence - _senders[i].sequence;
+      // far behind means the sender restarted and counts from scratch
+      if (delta > 0 || delta < -RESTART_WINDOW) {
+        _senders[i].sequence = sequence;
+        return true;
+      }
+      return false;
+    }
+  }
+
+  _senders[_next].id = sender;
+  _senders[_next].sequence = sequence;
+  _next = (_next + 1) % GROUP_SENDERS;
+  return true;
+}
@@ -0,0 +1,72 @@
+#ifndef _GROUP_CODEC_H_
+#define _GROUP_CODEC_H_
+
+// wire format of the local multicast group, kept free of Arduino
+// dependencies so it also builds on the host
+
+#include <stddef.h>
+#include <stdint.h>
+
+// 16 bytes of message and a crc-16 over them
+#define GROUP_PACKET_SIZE 18
+#define GROUP_PROTOCOL_VERSION 2
+#define GROUP_SENDERS 8
+
+enum GroupMessageType {
+  Group_Touch = 1,
+  Group_State = 2,
+};
+
+enum GroupTouchEvent {
+  GroupTouch_Down = 0,
+  GroupTouch_Up = 1,
+  GroupTouch_Long = 2,
+};
+
+enum GroupStateFields {
+  GroupField_On = 1 << 0,
+  GroupField_Channels = 1 << 1,
+  GroupField_Brightness = 1 << 2,
+  GroupField_OpenPercent = 1 << 3,
+};
+
+// GroupField_Channels carries the channel count in the upper bits
+#define GROUP_CHANNELS_SHIFT 4
+#define GROUP_CHANNELS_MASK 0x07
+
+struct GroupMessage {
+  uint8_t type;
+  uint16_t group;
+  uint32_t sender;
+  uint16_t sequence;
+  // Group_Touch
+  uint8_t key;
+  uint8_t event;
+  // Group_State
+  uint8_t fields;
+  uint8_t on; // bit 0 for GroupField_On, one bit per channel otherwise
+  uint8_t brightness;
+  uint8_t openPercent;
+};
+
+uint16_t groupId(const char *name);
+uint16_t groupCrc(const uint8_t *buffer, size_t length);
+size_t encodeGroupMessage(const GroupMessage &message, uint8_t *buffer,
+                          size_t size);
+bool decodeGroupMessage(const uint8_t *buffer, size_t length,
+                        GroupMessage &message);
+
+// drops repeated and reordered packets, tolerates sender restarts
+class GroupSequenceFilter {
+  struct Sender {
+    uint32_t id;
+    uint16_t sequence;
+  };
+  Sender _senders[GROUP_SENDERS] = {};
+  uint8_t _next = 0;
+
+public:
+  bool accept(uint32_t sender, uint16_t sequence);
+};
+
+#endif
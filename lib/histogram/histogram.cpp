@@ -0,0 +1,74 @@
+#include "histogram.h"
+
+const uint32_t Histogram::bounds[HISTOGRAM_BUCKETS - 1] = {
+    100,   250,    500,    1000,   2500,   5000,   10000,
+    25000, 50000, 100000, 250000, 500000, 1000000,
+};
+
+Histogram::Histogram() { reset(); }
+
+void Histogram::record(uint32_t value) {
+  uint8_t index = 0;
+  while (index < HISTOGRAM_BUCKETS - 1 && value > bounds[index]) {
+    index++;
+  }
+
+  _buckets[index].fetch_add(1, std::memory_order_relaxed);
+  _count.fetch_add(1, std::memory_order_relaxed);
+  _sum.fetch_add(value, std::memory_order_relaxed);
+
+  uint32_t max = _max.load(std::memory_order_relaxed);
+  while (value > max &&
+         !_max.compare_exchange_weak(max, value, std::memory_order_relaxed)) {
+  }
+}
+
+void Histogram::reset() {
+  for (uint8_t i = 0; i < HISTOGRAM_BUCKETS; i++) {
+    _buckets[i].store(0, std::memory_order_relaxed);
+  }
+  _count.store(0, std::memory_order_relaxed);
+  _sum.store(0, std::memory_order_relaxed);
+  _max.store(0, std::memory_order_relaxed);
+}
+
+uint32_t Histogram::count() const {
+  return _count.load(std::memory_order_relaxed);
+}
+
+uint64_t Histogram::sum() const { return _sum.load(std::memory_order_relaxed); }
+
+uint32_t Histogram::bucket(uint8_t index) const {
+  return _buckets[index].load(std::memory_order_relaxed);
+}
+
+uint32_t Histogram::percentile(uint8_t percent) const {
+  uint32_t total = count();
+  if (!total) {
+    return 0;
+  }
+
+  // upper bound of the bucket holding the requested rank
+  uint32_t rank = (total * percent + 99) / 100;
+  uint32_t seen = 0;
+  for (uint8_t i = 0; i < HISTOGRAM_BUCKETS - 1; i++) {
+    seen += bucket(i);
+    if (seen >= rank) {
+      return bounds[i];
+    }
+  }
+  return _max.load(std::memory_order_relaxed);
+}
+
+void Histogram::appendTo(JsonVariant doc) const {
+  doc["count"] = count();
+  doc["sum"] = sum();
+  doc["max"] = _max.load(std::memory_order_relaxed);
+  doc["p50"] = percentile(50);
+  doc["p99"] = percentile(99);
+
+  auto buckets = doc["buckets"].to<JsonArray>();
+  for (uint8_t i = 0; i < HISTOGRAM_BUCKETS; i++) {
+    buckets.add(bucket(i));
+  }
+}
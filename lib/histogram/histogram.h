@@ -0,0 +1,32 @@
+#ifndef _HISTOGRAM_H_
+#define _HISTOGRAM_H_
+
+#include <ArduinoJson.h>
+#include <atomic>
+
+#define HISTOGRAM_BUCKETS 14
+
+// fixed bucket histogram in usec, can be fed from any task. The 32 bit
+// counters are lock free, the 64 bit sum is not on Xtensa: libatomic runs
+// each add in a short critical section.
+class Histogram {
+  std::atomic<uint32_t> _buckets[HISTOGRAM_BUCKETS];
+  std::atomic<uint32_t> _count;
+  // 32 bits of usec would wrap after 71 minutes of recorded time
+  std::atomic<uint64_t> _sum;
+  std::atomic<uint32_t> _max;
+
+public:
+  static const uint32_t bounds[HISTOGRAM_BUCKETS - 1];
+
+  Histogram();
+  void record(uint32_t value);
+  void reset();
+  uint32_t count() const;
+  uint64_t sum() const;
+  uint32_t bucket(uint8_t index) const;
+  uint32_t percentile(uint8_t percent) const;
+  void appendTo(JsonVariant doc) const;
+};
+
+#endif
@@ -1,10 +1,15 @@
 #include "io.h"
+#include "latency.h"
+#include "metrics.h"
+#include "power.h"
 
 #define IO_PRESS_REPEAT MSEC(25)
+#define IO_LONG_PRESS MSEC(800)
+#define IO_PERIOD MSEC(5)
 
-Io::Io() : _qt(Wire) {
+Io::Io() : _qt(Wire), _ledRed(-1) {
   for (uint8_t i = 0; i < IO_CNT; i++)
-    _ledPins[i] = -1;
+    _ledPins[i] = _inputs[i] = -1;
 }
 
 bool Io::useLedPins(int8_t led1, int8_t led2, int8_t led3, int8_t redLed,
@@ -12,6 +17,11 @@ bool Io::useLedPins(int8_t led1, int8_t led2, int8_t led3, int8_t redLed,
   bool pinsChanged = _ledPins[0] != led1 || _ledPins[1] != led2 ||
                      _ledPins[2] != led3 || _ledRed != redLed;
 
+  if (pinsChanged) {
+    // the old pins have to be detached before they are forgotten
+    end();
+  }
+
   _ledPins[0] = led1;
   _ledPins[1] = led2;
   _ledPins[2] = led3;
@@ -24,7 +34,10 @@ bool Io::useLedPins(int8_t led1, int8_t led2, int8_t led3, int8_t redLed,
 bool Io::useQtTouch(int8_t sdaPin, int8_t sclPin, int8_t ch1, int8_t ch2,
                     int8_t ch3) {
   bool pinsChanged = _qt.usePins(sdaPin, sclPin) || _use != UseQt;
-  _qt.useChannels(ch1, ch2, ch3);
+  bool channelsChanged = _qt.useChannels(ch1, ch2, ch3);
+  if (pinsChanged || channelsChanged) {
+    end();
+  }
   _use = UseQt;
   return pinsChanged;
 }
@@ -32,6 +45,9 @@ bool Io::useQtTouch(int8_t sdaPin, int8_t sclPin, int8_t ch1, int8_t ch2,
 bool Io::useInputPins(int8_t i1, int8_t i2, int8_t i3) {
   bool pinsChanged =
       _inputs[0] != i1 || _inputs[1] != i2 || _inputs[2] != i3 || _use != UseIo;
+  if (pinsChanged) {
+    end();
+  }
 
   _inputs[0] = i1;
   _inputs[1] = i2;
@@ -41,11 +57,15 @@ bool Io::useInputPins(int8_t i1, int8_t i2, int8_t i3) {
 }
 
 void Io::begin(uint32_t ignorePeriodAfterTouchUp, bool oneKeyAtATime) {
+  _ignorePeriodAfterTouchUp = ignorePeriodAfterTouchUp;
+
   if (_initialized) {
-    return;
+    if (oneKeyAtATime == _oneKeyAtATime) {
+      return;
+    }
+    end();
   }
-
-  _ignorePeriodAfterTouchUp = ignorePeriodAfterTouchUp;
+  _oneKeyAtATime = oneKeyAtATime;
 
   for (uint8_t i = 0; i < IO_CNT; i++) {
     if (_ledPins[i] != -1) {
@@ -68,17 +88,53 @@ void Io::begin(uint32_t ignorePeriodAfterTouchUp, bool oneKeyAtATime) {
     break;
   }
 
-  _ticker.attach_ms(5, Io::handle, this);
+  _ticker.attach_ms(IO_PERIOD, Io::handle, this);
 
   updateLeds();
   _initialized = true;
 }
 
+void Io::end() {
+  if (!_initialized) {
+    return;
+  }
+
+  // a tick that is already running finishes before the bus is released
+  _ticker.detachAndWait();
+
+  for (uint8_t i = 0; i < IO_CNT; i++) {
+    if (_ledPins[i] != -1) {
+      ledcDetach(_ledPins[i]);
+    }
+  }
+
+  if (_ledRed != -1) {
+    ledcDetach(_ledRed);
+  }
+
+  if (_use == UseQt) {
+    _qt.end();
+  }
+
+  _pressed = _stablePressed = 0;
+  _stableUpdated = true;
+  _ignoreEventsStart = 0;
+  _pressedSince = 0;
+  _longPressSent = false;
+  _initialized = false;
+}
+
 void Io::handle(Io *instance) {
+  MetricScope scope(Callback_Io);
   Io &io = *instance;
   uint8_t pressed = 0;
   auto now = millis();
 
+  if (now - io._lastSnapshot >= io._snapshotInterval) {
+    io._lastSnapshot = now;
+    io.takeSnapshot();
+  }
+
   if (io._ignoreEventsStart) {
     if (now <= io._ignoreEventsStart + io._ignorePeriodAfterTouchUp)
       return;
@@ -89,6 +145,10 @@ void Io::handle(Io *instance) {
     pressed = io._qt.pressed();
 
     if (pressed != io._stablePressed) {
+      if (!io._stableUpdated) {
+        // changed again before the previous change settled
+        Metrics::count(Metric_DebounceRejects);
+      }
       io._stablePressed = pressed;
       io._lastStableChange = now;
       io._stableUpdated = false;
@@ -103,6 +163,10 @@ void Io::handle(Io *instance) {
     }
 
     if (pressed != io._stablePressed) {
+      if (!io._stableUpdated) {
+        // changed again before the previous change settled
+        Metrics::count(Metric_DebounceRejects);
+      }
       io._stablePressed = pressed;
       io._lastStableChange = now;
       io._stableUpdated = false;
@@ -115,12 +179,17 @@ void Io::handle(Io *instance) {
 
     if (io._stablePressed != io._pressed) {
 
-      if (!io._suspendInputs && io._touchUp) {
+      if (!io._suspendInputs) {
         for (uint8_t i = 0; i < IO_CNT; i++) {
           uint8_t mask = 1 << i;
           if ((io._pressed & mask) && !(io._stablePressed & mask)) {
             // was pressed, but not anymore
-            io._touchUp(i);
+            if (io._touchUp) {
+              io._touchUp(i);
+            }
+            if (io._keyEvent) {
+              io._keyEvent(i, Key_Up);
+            }
           }
         }
       }
@@ -131,14 +200,24 @@ void Io::handle(Io *instance) {
 
       auto lastPressed = io._pressed;
       io._pressed = io._stablePressed;
+      io._pressedSince = now;
+      io._longPressSent = false;
       io.updateLeds();
 
-      if (!io._suspendInputs && io._touchDown) {
+      if (!io._suspendInputs) {
         for (uint8_t i = 0; i < IO_CNT; i++) {
           uint8_t mask = 1 << i;
           if (!(lastPressed & mask) && (io._pressed & mask)) {
             // is pressed now, but was not before
-            io._touchDown(i);
+            Metrics::count(Metric_TouchEvents);
+            CommandLatency::touched();
+            Power::interaction();
+            if (io._touchDown) {
+              io._touchDown(i);
+            }
+            if (io._keyEvent) {
+              io._keyEvent(i, Key_Down);
+            }
           }
         }
       }
@@ -147,6 +226,17 @@ void Io::handle(Io *instance) {
     }
   }
 
+  // once per hold, the key event stream has no repeats
+  if (!io._suspendInputs && io._keyEvent && io._pressed &&
+      !io._longPressSent && now - io._pressedSince >= IO_LONG_PRESS) {
+    io._longPressSent = true;
+    for (uint8_t i = 0; i < IO_CNT; i++) {
+      if (io._pressed & (1 << i)) {
+        io._keyEvent(i, Key_LongPress);
+      }
+    }
+  }
+
   if (!io._suspendInputs && io._touchPress && io._pressed &&
       now - io._lastSentEvent >= IO_PRESS_REPEAT) {
     io._lastSentEvent = now;
@@ -173,6 +263,11 @@ Io &Io::onTouchUp(TouchKeyHandler handler) {
   return *this;
 }
 
+Io &Io::onKeyEvent(KeyEventHandler handler) {
+  _keyEvent = handler;
+  return *this;
+}
+
 Io &Io::setLedLevels(uint8_t b1, uint8_t b2, uint8_t b3, uint8_t bTouch,
                      uint8_t red) {
   _levelBlue[0] = b1;
@@ -196,25 +291,94 @@ void Io::updateLeds() {
   }
 }
 
-void Io::appendStatus(JsonVariant doc) const {
-  doc["io"]["suspendInputs"] = _suspendInputs;
-  auto ioChannels = doc["io"]["channels"].to<JsonArray>();
+void Io::takeSnapshot() {
+  // the hardware reads happen here, on the same task that owns Wire
+  IoSnapshot snapshot = {};
+  snapshot.pressed = _pressed;
+  snapshot.suspendInputs = _suspendInputs;
   if (_use == UseQt) {
+    snapshot.hasThreshold = true;
     for (uint8_t i = 0; i < IO_CNT; i++) {
       auto value = _qt.signal(i);
       if (value == 0)
         continue;
-      auto parent = ioChannels.add<JsonObject>();
-      parent["value"] = value;
-      parent["threshold"] = _qt.reference(i);
+      snapshot.value[snapshot.channels] = value;
+      snapshot.threshold[snapshot.channels] = _qt.reference(i);
+      snapshot.channels++;
     }
   } else if (_use == UseIo) {
     for (uint8_t i = 0; i < IO_CNT; i++) {
       if (_inputs[i] == -1) {
         continue;
       }
-      auto parent = ioChannels.add<JsonObject>();
-      parent["value"] = digitalRead(_inputs[i]);
+      snapshot.value[snapshot.channels++] = digitalRead(_inputs[i]);
+    }
+  }
+
+  auto sequence = _snapshotSequence.load(std::memory_order_relaxed);
+  _snapshotSequence.store(sequence + 1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  _snapshot = snapshot;
+  _snapshotSequence.store(sequence + 2, std::memory_order_release);
+}
+
+uint32_t Io::readSnapshot(IoSnapshot &snapshot) const {
+  // the writer never waits, a reader that raced with it just copies again
+  for (uint8_t attempt = 0; attempt < 8; attempt++) {
+    auto sequence = _snapshotSequence.load(std::memory_order_acquire);
+    if (sequence & 1) {
+      continue;
+    }
+    snapshot = _snapshot;
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (_snapshotSequence.load(std::memory_order_relaxed) == sequence) {
+      return sequence;
+    }
+  }
+
+  snapshot = {};
+  return 0;
+}
+
+Io &Io::setSnapshotInterval(uint32_t interval) {
+  _snapshotInterval = interval;
+  return *this;
+}
+
+void Io::appendStatus(JsonVariant doc) const {
+  IoSnapshot snapshot;
+  readSnapshot(snapshot);
+  appendSnapshot(doc, snapshot);
+}
+
+bool Io::appendStatusIfChanged(JsonVariant doc, IoSnapshot &last) const {
+  IoSnapshot snapshot;
+  readSnapshot(snapshot);
+
+  bool changed = snapshot.pressed != last.pressed ||
+                 snapshot.suspendInputs != last.suspendInputs ||
+                 snapshot.channels != last.channels;
+  for (uint8_t i = 0; i < snapshot.channels && !changed; i++) {
+    changed = snapshot.value[i] != last.value[i] ||
+              snapshot.threshold[i] != last.threshold[i];
+  }
+
+  if (changed) {
+    last = snapshot;
+    appendSnapshot(doc, snapshot);
+  }
+  return changed;
+}
+
+void Io::appendSnapshot(JsonVariant doc, const IoSnapshot &snapshot) {
+  doc["io"]["suspendInputs"] = snapshot.suspendInputs;
+  doc["io"]["pressed"] = snapshot.pressed;
+  auto ioChannels = doc["io"]["channels"].to<JsonArray>();
+  for (uint8_t i = 0; i < snapshot.channels; i++) {
+    auto parent = ioChannels.add<JsonObject>();
+    parent["value"] = snapshot.value[i];
+    if (snapshot.hasThreshold) {
+      parent["threshold"] = snapshot.threshold[i];
     }
   }
 }
@@ -2,16 +2,29 @@
 #define _IO_H_
 
 #include "qt1070.h"
+#include "timers.h"
 #include "util.h"
 #include <ArduinoJson.h>
-#include <Ticker.h>
+#include <atomic>
 
 #define IO_CNT 3
 
+enum KeyEvent { Key_Down, Key_Up, Key_LongPress };
+
 typedef std::function<void(int8_t key)> TouchKeyHandler;
+typedef std::function<void(int8_t key, KeyEvent event)> KeyEventHandler;
 
 enum Use { UseNone, UseQt, UseIo };
 
+struct IoSnapshot {
+  uint8_t pressed;
+  bool suspendInputs;
+  bool hasThreshold;
+  uint8_t channels;
+  uint16_t value[IO_CNT];
+  uint16_t threshold[IO_CNT];
+};
+
 class Io {
 private:
   Qt1070 _qt;
@@ -22,15 +35,25 @@ private:
   bool _invertLedRed, _stableUpdated;
   uint8_t _pressed = 0, _stablePressed = 0, _debounce;
   uint32_t _lastSentEvent, _lastStableChange, _ignoreEventsStart;
-  Ticker _ticker;
+  uint32_t _pressedSince = 0;
+  bool _longPressSent = false;
+  Timer _ticker{"io"};
   static void handle(Io *instance);
   uint8_t _levelBlue[IO_CNT], _levelBlueTouched, _levelRed;
-  bool _initialized = false;
+  bool _initialized = false, _oneKeyAtATime = true;
   uint32_t _ignorePeriodAfterTouchUp;
   bool _suspendInputs = false;
 
+  // written by the io ticker only, readers copy it under a seqlock
+  IoSnapshot _snapshot = {};
+  std::atomic<uint32_t> _snapshotSequence{0};
+  uint32_t _snapshotInterval = MSEC(250), _lastSnapshot = 0;
+  void takeSnapshot();
+  static void appendSnapshot(JsonVariant doc, const IoSnapshot &snapshot);
+
   TouchKeyHandler _touchDown, _touchPress;
   TouchKeyHandler _touchUp;
+  KeyEventHandler _keyEvent;
   void updateLeds();
 
 public:
@@ -48,8 +71,13 @@ public:
   Io &onTouchDown(TouchKeyHandler handler);
   Io &onTouchPress(TouchKeyHandler handler);
   Io &onTouchUp(TouchKeyHandler handler);
+  Io &onKeyEvent(KeyEventHandler handler);
+  Io &setSnapshotInterval(uint32_t interval);
   void begin(uint32_t ignorePeriodAfterTouchUp, bool oneKeyAtATime);
+  void end();
   void appendStatus(JsonVariant doc) const;
+  uint32_t readSnapshot(IoSnapshot &snapshot) const;
+  bool appendStatusIfChanged(JsonVariant doc, IoSnapshot &last) const;
 
   void setSuspendInputs(bool suspend);
 };
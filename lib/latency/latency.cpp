@@ -0,0 +1,98 @@
+#include "latency.h"
+#include "util.h"
+#include <esp_timer.h>
+
+#define USEC(ms) ((int64_t)(ms) * 1000)
+#define APPLY_TIMEOUT USEC(SECS(2))
+
+static const char *stageNames[Latency_StageCount] = {
+    "parse", "dispatch", "apply", "total", "confirm", "roundTrip",
+};
+
+std::atomic<int64_t> CommandLatency::_received(0);
+std::atomic<int64_t> CommandLatency::_parsed(0);
+std::atomic<int64_t> CommandLatency::_dispatched(0);
+std::atomic<bool> CommandLatency::_pendingApply(false);
+std::atomic<bool> CommandLatency::_pendingConfirm(false);
+std::atomic<bool> CommandLatency::_publishedForCommand(false);
+std::atomic<int64_t> CommandLatency::_published(0);
+std::atomic<int> CommandLatency::_publishedMsgId(0);
+Histogram CommandLatency::_histograms[Latency_StageCount];
+
+static uint32_t elapsed(int64_t since, int64_t now) {
+  int64_t value = now - since;
+  return value < 0 ? 0 : value > UINT32_MAX ? UINT32_MAX : value;
+}
+
+void CommandLatency::received() {
+  _pendingApply = false;
+  _received = esp_timer_get_time();
+}
+
+void CommandLatency::parsed() {
+  auto now = esp_timer_get_time();
+  _parsed = now;
+  _histograms[Latency_Parse].record(elapsed(_received, now));
+}
+
+void CommandLatency::dispatched() {
+  auto now = esp_timer_get_time();
+  _dispatched = now;
+  _histograms[Latency_Dispatch].record(elapsed(_parsed, now));
+  _pendingConfirm = true;
+  _pendingApply = true;
+}
+
+void CommandLatency::applied() {
+  if (!_pendingApply.exchange(false)) {
+    return;
+  }
+
+  auto now = esp_timer_get_time();
+  if (now - _dispatched > APPLY_TIMEOUT) {
+    // command did not change any output, this is something else
+    return;
+  }
+
+  _histograms[Latency_Apply].record(elapsed(_dispatched, now));
+  _histograms[Latency_Total].record(elapsed(_received, now));
+}
+
+void CommandLatency::touched() {
+  _pendingApply = false;
+  _pendingConfirm = false;
+}
+
+bool CommandLatency::awaitsConfirm() { return _pendingConfirm; }
+
+void CommandLatency::published(int msgId) {
+  if (msgId <= 0) {
+    return;
+  }
+
+  _publishedForCommand = _pendingConfirm.exchange(false);
+  _published = esp_timer_get_time();
+  _publishedMsgId = msgId;
+}
+
+void CommandLatency::acked(int msgId) {
+  if (msgId != _publishedMsgId) {
+    return;
+  }
+
+  auto now = esp_timer_get_time();
+  _histograms[Latency_Confirm].record(elapsed(_published, now));
+  if (_publishedForCommand.exchange(false)) {
+    _histograms[Latency_RoundTrip].record(elapsed(_received, now));
+  }
+}
+
+bool CommandLatency::hasSamples() {
+  return _histograms[Latency_Parse].count() > 0;
+}
+
+void CommandLatency::appendStatus(JsonVariant doc) {
+  for (uint8_t i = 0; i < Latency_StageCount; i++) {
+    _histograms[i].appendTo(doc[stageNames[i]].to<JsonObject>());
+  }
+}
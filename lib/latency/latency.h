@@ -0,0 +1,43 @@
+#ifndef _LATENCY_H_
+#define _LATENCY_H_
+
+#include "histogram.h"
+#include <ArduinoJson.h>
+#include <atomic>
+
+enum LatencyStage {
+  Latency_Parse = 0, // message received -> JSON parsed
+  Latency_Dispatch,  // JSON parsed -> handed to the switch
+  Latency_Apply,     // handed to the switch -> output written
+  Latency_Total,     // message received -> output written
+  Latency_Confirm,   // state published -> broker ack
+  Latency_RoundTrip, // message received -> broker acked resulting state
+  Latency_StageCount,
+};
+
+// end-to-end timing of state/set commands, timestamps are esp_timer usec
+class CommandLatency {
+  static std::atomic<int64_t> _received, _parsed, _dispatched;
+  static std::atomic<bool> _pendingApply, _pendingConfirm;
+  static std::atomic<bool> _publishedForCommand;
+  static std::atomic<int64_t> _published;
+  static std::atomic<int> _publishedMsgId;
+  static Histogram _histograms[Latency_StageCount];
+
+public:
+  static void received();
+  static void parsed();
+  static void dispatched();
+  static void applied();
+  // a local touch, the next output change is not the command's
+  static void touched();
+  // the next state publish answers a command
+  static bool awaitsConfirm();
+  static void published(int msgId);
+  static void acked(int msgId);
+
+  static bool hasSamples();
+  static void appendStatus(JsonVariant doc);
+};
+
+#endif
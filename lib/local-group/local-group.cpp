@@ -0,0 +1,176 @@
+#include "local-group.h"
+#include "util.h"
+
+#define ECHO_WINDOW SECS(2)
+
+LocalGroup::LocalGroup() {
+  // last 4 bytes of the MAC, the first ones are the vendor prefix
+  _sender = ESP.getEfuseMac() >> 16;
+  _sequence = esp_random();
+}
+
+void LocalGroup::configure(const GroupConfig &config) {
+  _enabled = config.name.length() && _address.fromString(config.address);
+  _group = groupId(config.name.c_str());
+  _port = config.port;
+  _repeat = config.repeat;
+
+  if (!_enabled) {
+    _udp.close();
+  }
+}
+
+void LocalGroup::listen() {
+  _udp.close();
+  if (!_enabled) {
+    return;
+  }
+
+  _udp.onPacket([this](AsyncUDPPacket &packet) { handlePacket(packet); });
+  _udp.listenMulticast(_address, _port);
+}
+
+void LocalGroup::handlePacket(AsyncUDPPacket &packet) {
+  GroupMessage message;
+  if (!decodeGroupMessage(packet.data(), packet.length(), message) ||
+      message.group != _group || message.sender == _sender) {
+    return;
+  }
+
+  if (!_filter.accept(message.sender, message.sequence)) {
+    _dropped++;
+    return;
+  }
+  _received++;
+
+  if (message.type == Group_Touch) {
+    if (_touchHandler) {
+      _touchHandler(message.sender, message.key, message.event);
+    }
+  } else if (message.type == Group_State) {
+    _lastReceivedState = message;
+    _lastReceivedAt = millis();
+    _lastSentState.fields = 0;
+
+    if (!_stateHandler) {
+      return;
+    }
+
+    JsonDocument state;
+    if (message.fields & GroupField_On) {
+      state["on"] = (message.on & 1) != 0;
+    } else if (message.fields & GroupField_Channels) {
+      auto on = state["on"].to<JsonArray>();
+      uint8_t channels =
+          message.fields >> GROUP_CHANNELS_SHIFT & GROUP_CHANNELS_MASK;
+      for (uint8_t i = 0; i < channels; i++) {
+        on.add((message.on & (1 << i)) != 0);
+      }
+    }
+    if (message.fields & GroupField_Brightness) {
+      state["brightness"] = message.brightness;
+    }
+    if (message.fields & GroupField_OpenPercent) {
+      state["openPercent"] = message.openPercent;
+    }
+    _stateHandler(state);
+  }
+}
+
+void LocalGroup::send(GroupMessage &message) {
+  message.group = _group;
+  message.sender = _sender;
+  message.sequence = ++_sequence;
+
+  uint8_t buffer[GROUP_PACKET_SIZE];
+  size_t length = encodeGroupMessage(message, buffer, sizeof(buffer));
+
+  // multicast has no retransmissions, repeats are dropped by the sequence
+  // filter on the receiving side
+  for (uint8_t i = 0; i < _repeat; i++) {
+    _udp.writeTo(buffer, length, _address, _port);
+  }
+  _sent++;
+}
+
+void LocalGroup::sendTouch(int8_t key, uint8_t event) {
+  if (!_enabled) {
+    return;
+  }
+
+  GroupMessage message = {};
+  message.type = Group_Touch;
+  message.key = key;
+  message.event = event;
+  send(message);
+}
+
+bool LocalGroup::isSameState(const GroupMessage &a, const GroupMessage &b) {
+  return a.fields == b.fields && a.on == b.on &&
+         a.brightness == b.brightness && a.openPercent == b.openPercent;
+}
+
+bool LocalGroup::isEcho(const GroupMessage &message) const {
+  // state we just applied from the group, sending it back would make two
+  // devices touched at the same time bounce their states forever
+  return _lastReceivedAt && millis() - _lastReceivedAt < ECHO_WINDOW &&
+         isSameState(message, _lastReceivedState);
+}
+
+void LocalGroup::sendState(JsonVariantConst state) {
+  if (!_enabled) {
+    return;
+  }
+
+  GroupMessage message = {};
+  message.type = Group_State;
+
+  auto on = state["on"];
+  if (on.is<bool>()) {
+    message.fields |= GroupField_On;
+    message.on = on.as<bool>() ? 1 : 0;
+  } else if (on.is<JsonArrayConst>()) {
+    uint8_t channels = 0;
+    for (JsonVariantConst channel : on.as<JsonArrayConst>()) {
+      if (channels == GROUP_CHANNELS_MASK) {
+        break;
+      }
+      if (channel.as<bool>()) {
+        message.on |= 1 << channels;
+      }
+      channels++;
+    }
+    message.fields |= GroupField_Channels | channels << GROUP_CHANNELS_SHIFT;
+  }
+
+  if (state["brightness"].is<uint8_t>()) {
+    message.fields |= GroupField_Brightness;
+    message.brightness = state["brightness"];
+  }
+
+  if (state["openPercent"].is<uint8_t>()) {
+    message.fields |= GroupField_OpenPercent;
+    message.openPercent = state["openPercent"];
+  }
+
+  // periodic and throttled state publishes repeat the same state
+  if (!message.fields || isSameState(message, _lastSentState) ||
+      isEcho(message)) {
+    return;
+  }
+
+  _lastReceivedAt = 0;
+  _lastSentState = message;
+  send(message);
+}
+
+void LocalGroup::onState(GroupStateHandler handler) { _stateHandler = handler; }
+
+void LocalGroup::onTouch(GroupTouchHandler handler) { _touchHandler = handler; }
+
+void LocalGroup::appendStatus(JsonVariant doc) const {
+  doc["enabled"] = _enabled;
+  doc["sent"] = _sent;
+  doc["received"] = _received;
+  doc["dropped"] = _dropped;
+}
@@ -0,0 +1,47 @@
+#ifndef _LOCAL_GROUP_H_
+#define _LOCAL_GROUP_H_
+
+#include "config-model.h"
+#include "group-codec.h"
+#include <ArduinoJson.h>
+#include <AsyncUDP.h>
+
+typedef std::function<void(JsonVariant state)> GroupStateHandler;
+typedef std::function<void(uint32_t sender, uint8_t key, uint8_t event)>
+    GroupTouchHandler;
+
+class LocalGroup {
+  AsyncUDP _udp;
+  IPAddress _address;
+  uint16_t _port = 0;
+  uint16_t _group = 0;
+  uint32_t _sender;
+  uint16_t _sequence;
+  uint8_t _repeat = 2;
+  bool _enabled = false;
+  GroupSequenceFilter _filter;
+  GroupMessage _lastReceivedState = {};
+  GroupMessage _lastSentState = {};
+  uint32_t _lastReceivedAt = 0;
+  GroupStateHandler _stateHandler;
+  GroupTouchHandler _touchHandler;
+  uint32_t _sent = 0, _received = 0, _dropped = 0;
+
+  void send(GroupMessage &message);
+  void handlePacket(AsyncUDPPacket &packet);
+  bool isEcho(const GroupMessage &message) const;
+  static bool isSameState(const GroupMessage &a, const GroupMessage &b);
+
+public:
+  LocalGroup();
+
+  void configure(const GroupConfig &config);
+  void listen();
+  void sendTouch(int8_t key, uint8_t event);
+  void sendState(JsonVariantConst state);
+  void onState(GroupStateHandler handler);
+  void onTouch(GroupTouchHandler handler);
+  void appendStatus(JsonVariant doc) const;
+};
+
+#endif
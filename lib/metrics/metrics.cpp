@@ -0,0 +1,101 @@
+#include "metrics.h"
+#include <WiFi.h>
+
+#define PREFIX "ha_switch_"
+
+std::atomic<uint32_t> Metrics::_counters[Metric_CounterCount];
+Histogram Metrics::_callbacks[Callback_Count];
+
+static const char *const counterNames[Metric_CounterCount] = {
+    "mqtt_publishes_total",
+    "mqtt_publish_drops_total",
+    "mqtt_reconnects_total",
+    "i2c_errors_total",
+    "touch_events_total",
+    "touch_debounce_rejects_total",
+    "dimmer_steps_total",
+    "blinds_motor_seconds_total",
+    "relay_switches_synced_total",
+    "relay_switches_immediate_total",
+    "relay_switches_delayed_total",
+    "timer_wakeups_total",
+    "modem_wakeups_total",
+};
+
+static const char *const callbackNames[Callback_Count] = {
+    "io",
+    "supervisor",
+    "dimmer",
+    "blinds",
+    "relays",
+};
+
+static const char *const taskNames[] = {
+    "loopTask", "async_tcp", "esp_timer", "mqtt_task", "tiT", "arduino_events",
+};
+
+void Metrics::count(MetricCounter counter, uint32_t amount) {
+  _counters[counter].fetch_add(amount, std::memory_order_relaxed);
+}
+
+void Metrics::time(MetricCallback callback, uint32_t usec) {
+  _callbacks[callback].record(usec);
+}
+
+static void writeGauge(Print &out, const char *name, double value) {
+  out.printf("# TYPE " PREFIX "%s gauge\n" PREFIX "%s %g\n", name, name,
+             value);
+}
+
+void Metrics::write(Print &out) {
+  for (uint8_t i = 0; i < Metric_CounterCount; i++) {
+    uint32_t value = _counters[i].load(std::memory_order_relaxed);
+    out.printf("# TYPE " PREFIX "%s counter\n", counterNames[i]);
+    if (i == Metric_BlindsMotorMs) {
+      out.printf(PREFIX "%s %.3f\n", counterNames[i], value / 1000.0);
+    } else {
+      out.printf(PREFIX "%s %u\n", counterNames[i], (unsigned int)value);
+    }
+  }
+
+  out.print("# TYPE " PREFIX "callback_duration_seconds histogram\n");
+  for (uint8_t i = 0; i < Callback_Count; i++) {
+    const Histogram &histogram = _callbacks[i];
+    uint32_t cumulative = 0;
+    for (uint8_t b = 0; b < HISTOGRAM_BUCKETS; b++) {
+      cumulative += histogram.bucket(b);
+      if (b < HISTOGRAM_BUCKETS - 1) {
+        out.printf(PREFIX
+                   "callback_duration_seconds_bucket{callback=\"%s\",le=\"%g\"}"
+                   " %u\n",
+                   callbackNames[i], Histogram::bounds[b] / 1e6,
+                   (unsigned int)cumulative);
+      }
+    }
+    // derived from the buckets so the series stay consistent with each other
+    out.printf(PREFIX "callback_duration_seconds_bucket{callback=\"%s\","
+                      "le=\"+Inf\"} %u\n",
+               callbackNames[i], (unsigned int)cumulative);
+    out.printf(PREFIX "callback_duration_seconds_sum{callback=\"%s\"} %g\n",
+               callbackNames[i], histogram.sum() / 1e6);
+    out.printf(PREFIX "callback_duration_seconds_count{callback=\"%s\"} %u\n",
+               callbackNames[i], (unsigned int)cumulative);
+  }
+
+  writeGauge(out, "uptime_seconds", esp_timer_get_time() / 1e6);
+  writeGauge(out, "heap_free_bytes", ESP.getFreeHeap());
+  writeGauge(out, "heap_min_free_bytes", ESP.getMinFreeHeap());
+  writeGauge(out, "heap_largest_block_bytes", ESP.getMaxAllocHeap());
+  if (WiFi.isConnected()) {
+    writeGauge(out, "wifi_rssi_dbm", WiFi.RSSI());
+  }
+
+  out.print("# TYPE " PREFIX "task_stack_free_bytes gauge\n");
+  for (auto name : taskNames) {
+    TaskHandle_t task = xTaskGetHandle(name);
+    if (task) {
+      out.printf(PREFIX "task_stack_free_bytes{task=\"%s\"} %u\n", name,
+                 (unsigned int)uxTaskGetStackHighWaterMark(task));
+    }
+  }
+}
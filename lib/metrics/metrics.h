@@ -0,0 +1,59 @@
+#ifndef _METRICS_H_
+#define _METRICS_H_
+
+#include "histogram.h"
+#include <Arduino.h>
+#include <atomic>
+#include <esp_timer.h>
+
+enum MetricCounter {
+  Metric_MqttPublishes = 0,
+  Metric_MqttPublishDrops,
+  Metric_MqttReconnects,
+  Metric_I2cErrors,
+  Metric_TouchEvents,
+  Metric_DebounceRejects,
+  Metric_DimmerSteps,
+  Metric_BlindsMotorMs,
+  Metric_RelaysSynced,
+  Metric_RelaysImmediate,
+  // held back by the stagger gap without mains timing
+  Metric_RelaysDelayed,
+  Metric_TimerWakeups,
+  Metric_ModemWakeups,
+  Metric_CounterCount,
+};
+
+enum MetricCallback {
+  Callback_Io = 0,
+  Callback_Supervisor,
+  Callback_Dimmer,
+  Callback_Blinds,
+  Callback_Relays,
+  Callback_Count,
+};
+
+// process wide counters, relaxed atomics only so they stay enabled in
+// production builds
+class Metrics {
+  static std::atomic<uint32_t> _counters[Metric_CounterCount];
+  static Histogram _callbacks[Callback_Count];
+
+public:
+  static void count(MetricCounter counter, uint32_t amount = 1);
+  static void time(MetricCallback callback, uint32_t usec);
+  static void write(Print &out);
+};
+
+// times a ticker callback for as long as it is in scope
+class MetricScope {
+  MetricCallback _callback;
+  int64_t _start;
+
+public:
+  MetricScope(MetricCallback callback)
+      : _callback(callback), _start(esp_timer_get_time()) {}
+  ~MetricScope() { Metrics::time(_callback, esp_timer_get_time() - _start); }
+};
+
+#endif
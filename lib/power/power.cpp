@@ -0,0 +1,128 @@
+#include "power.h"
+#include "metrics.h"
+#include <WiFi.h>
+
+// typical figures for the estimate, radio listening vs modem sleep at 80 MHz
+#define RADIO_ON_MA 100
+#define MODEM_SLEEP_MA 30
+
+static const char *const lockNames[Power_LockCount] = {"i2c", "ota", "web"};
+static const esp_pm_lock_type_t lockTypes[Power_LockCount] = {
+    ESP_PM_APB_FREQ_MAX,
+    ESP_PM_CPU_FREQ_MAX,
+    ESP_PM_CPU_FREQ_MAX,
+};
+
+esp_pm_lock_handle_t Power::_locks[Power_LockCount];
+std::atomic<uint32_t> Power::_acquired[Power_LockCount];
+std::atomic<uint32_t> Power::_held[Power_LockCount];
+bool Power::_scaling = false, Power::_lightSleep = false,
+     Power::_modemSleep = true;
+uint32_t Power::_awakeFor = 0;
+Timer Power::_awakeTimer("modem-awake");
+std::atomic<bool> Power::_awake{false};
+std::atomic<uint32_t> Power::_modemWakes{0};
+int64_t Power::_awakeSince = 0, Power::_awakeUs = 0;
+
+void Power::configure(const PowerConfig &config) {
+  for (uint8_t i = 0; i < Power_LockCount; i++) {
+    if (!_locks[i]) {
+      esp_pm_lock_create(lockTypes[i], 0, lockNames[i], &_locks[i]);
+    }
+  }
+
+  esp_pm_config_t pm = {};
+  pm.max_freq_mhz = config.maxFreq;
+  pm.min_freq_mhz = config.minFreq;
+  pm.light_sleep_enable = config.lightSleep;
+  esp_err_t result = esp_pm_configure(&pm);
+  if (result != ESP_OK && pm.light_sleep_enable) {
+    // light sleep needs tickless idle in the sdkconfig, scale at least
+    pm.light_sleep_enable = false;
+    result = esp_pm_configure(&pm);
+  }
+  _scaling = result == ESP_OK;
+  _lightSleep = _scaling && pm.light_sleep_enable;
+  if (!_scaling) {
+    setCpuFrequencyMhz(config.maxFreq);
+  }
+
+  _awakeFor = config.awakeFor;
+  _modemSleep = config.modemSleep;
+  if (!_modemSleep || !_awakeFor) {
+    _awakeTimer.detach();
+    sleepModem();
+  }
+  WiFi.setSleep(_modemSleep && !_awake);
+}
+
+void Power::acquire(PowerLock lock) {
+  _acquired[lock].fetch_add(1, std::memory_order_relaxed);
+  _held[lock].fetch_add(1);
+  if (_locks[lock]) {
+    esp_pm_lock_acquire(_locks[lock]);
+  }
+}
+
+void Power::release(PowerLock lock) {
+  uint32_t held = _held[lock].load();
+  do {
+    if (!held) {
+      // an unbalanced esp_pm_lock_release would abort
+      return;
+    }
+  } while (!_held[lock].compare_exchange_weak(held, held - 1));
+
+  if (_locks[lock]) {
+    esp_pm_lock_release(_locks[lock]);
+  }
+}
+
+void Power::interaction() {
+  if (!_modemSleep || !_awakeFor) {
+    return;
+  }
+
+  if (!_awake.exchange(true)) {
+    _awakeSince = esp_timer_get_time();
+    _modemWakes++;
+    Metrics::count(Metric_ModemWakeups);
+    WiFi.setSleep(false);
+  }
+  // every interaction extends the window
+  _awakeTimer.once_ms(_awakeFor, Power::sleepModem);
+}
+
+void Power::sleepModem() {
+  if (_awake.exchange(false)) {
+    _awakeUs += esp_timer_get_time() - _awakeSince;
+    WiFi.setSleep(_modemSleep);
+  }
+}
+
+void Power::appendStatus(JsonVariant doc) {
+  doc["cpuMhz"] = getCpuFrequencyMhz();
+  doc["scaling"] = _scaling;
+  doc["lightSleep"] = _lightSleep;
+  doc["modemSleep"] = _modemSleep;
+  doc["modemAwake"] = _awake.load();
+  doc["modemWakes"] = _modemWakes.load();
+
+  int64_t now = esp_timer_get_time();
+  int64_t awakeUs = _awakeUs + (_awake ? now - _awakeSince : 0);
+  doc["modemAwakeMs"] = awakeUs / 1000;
+  // from the time spent with the radio listening, not a measurement
+  uint32_t awakePermille =
+      !_modemSleep ? 1000 : now ? awakeUs * 1000 / now : 0;
+  doc["estimatedMa"] = (RADIO_ON_MA * awakePermille +
+                        MODEM_SLEEP_MA * (1000 - awakePermille)) /
+                       1000;
+
+  // held right now and acquired since boot
+  auto locks = doc["locks"].to<JsonObject>();
+  auto acquired = doc["lockAcquires"].to<JsonObject>();
+  for (uint8_t i = 0; i < Power_LockCount; i++) {
+    locks[lockNames[i]] = _held[i].load();
+    acquired[lockNames[i]] = _acquired[i].load(std::memory_order_relaxed);
+  }
+}
@@ -0,0 +1,52 @@
+#ifndef _POWER_H_
+#define _POWER_H_
+
+#include "config-model.h"
+#include "timers.h"
+#include <ArduinoJson.h>
+#include <atomic>
+#include <esp_pm.h>
+
+enum PowerLock {
+  // the i2c clock is derived from the apb clock
+  Power_I2c = 0,
+  Power_Ota,
+  Power_Web,
+  Power_LockCount,
+};
+
+// frequency scaling, light sleep and modem sleep. Everything lower is
+// allowed while no lock is held.
+class Power {
+  static esp_pm_lock_handle_t _locks[Power_LockCount];
+  static std::atomic<uint32_t> _acquired[Power_LockCount];
+  static std::atomic<uint32_t> _held[Power_LockCount];
+  static bool _scaling, _lightSleep, _modemSleep;
+  static uint32_t _awakeFor;
+  static Timer _awakeTimer;
+  static std::atomic<bool> _awake;
+  static std::atomic<uint32_t> _modemWakes;
+  static int64_t _awakeSince, _awakeUs;
+
+  static void sleepModem();
+
+public:
+  static void configure(const PowerConfig &config);
+  static void acquire(PowerLock lock);
+  // ignored while the lock isn't held, like an OTA error before its start
+  static void release(PowerLock lock);
+  // keeps the radio awake for a while so follow up commands arrive fast
+  static void interaction();
+  static void appendStatus(JsonVariant doc);
+};
+
+// holds a lock for as long as it is in scope
+class PowerScope {
+  PowerLock _lock;
+
+public:
+  PowerScope(PowerLock lock) : _lock(lock) { Power::acquire(_lock); }
+  ~PowerScope() { Power::release(_lock); }
+};
+
+#endif
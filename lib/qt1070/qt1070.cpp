@@ -1,4 +1,6 @@
 #include "qt1070.h"
+#include "metrics.h"
+#include "power.h"
 
 #define QT_ADDR 0x1B
 
@@ -62,37 +64,50 @@ void Qt1070::begin(bool oneKeyAtATime) {
   }
 }
 
+void Qt1070::end() {
+  _initialized = false;
+  _wire.end();
+}
+
 void Qt1070::writeRegister(uint8_t address, uint8_t value) const {
+  PowerScope power(Power_I2c);
   _wire.beginTransmission(QT_ADDR);
   _wire.write(address);
   _wire.write(value);
-  _wire.endTransmission();
+  if (_wire.endTransmission()) {
+    Metrics::count(Metric_I2cErrors);
+  }
 }
 
 uint8_t Qt1070::readRegister(uint8_t address) const {
+  PowerScope power(Power_I2c);
   _wire.beginTransmission(QT_ADDR);
   _wire.write(address);
-  _wire.endTransmission();
-
-  _wire.requestFrom(QT_ADDR, 1U);
+  if (_wire.endTransmission() || _wire.requestFrom(QT_ADDR, 1U) != 1) {
+    Metrics::count(Metric_I2cErrors);
+  }
   uint8_t value = _wire.read();
   return value;
 }
 
 uint16_t Qt1070::readRegisterU16(uint8_t address) const {
+  PowerScope power(Power_I2c);
   _wire.beginTransmission(QT_ADDR);
   _wire.write(address);
-  _wire.endTransmission();
-
-  _wire.requestFrom(QT_ADDR, 2U);
+  if (_wire.endTransmission() || _wire.requestFrom(QT_ADDR, 2U) != 2) {
+    Metrics::count(Metric_I2cErrors);
+  }
   uint8_t value = _wire.read() << 8 | _wire.read();
   return value;
 }
 
-void Qt1070::useChannels(int8_t ch1, int8_t ch2, int8_t ch3) {
+bool Qt1070::useChannels(int8_t ch1, int8_t ch2, int8_t ch3) {
+  bool channelsChanged =
+      _channels[0] != ch1 || _channels[1] != ch2 || _channels[2] != ch3;
   _channels[0] = ch1;
   _channels[1] = ch2;
   _channels[2] = ch3;
+  return channelsChanged;
 }
 
 void Qt1070::calibrate() const {
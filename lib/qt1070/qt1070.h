@@ -10,7 +10,7 @@ class Qt1070 {
 private:
   TwoWire &_wire;
   int8_t _sda = -1, _scl = -1;
-  int8_t _channels[CH_COUNT];
+  int8_t _channels[CH_COUNT] = {-1, -1, -1};
   bool _initialized = false;
 
   void writeRegister(uint8_t address, uint8_t value) const;
@@ -21,8 +21,9 @@ public:
   Qt1070(TwoWire &wire);
 
   bool usePins(int8_t sda, int8_t scl);
-  void useChannels(int8_t ch1 = -1, int8_t ch2 = -1, int8_t ch3 = -1);
+  bool useChannels(int8_t ch1 = -1, int8_t ch2 = -1, int8_t ch3 = -1);
   void begin(bool oneKeyAtATime = true);
+  void end();
   void calibrate() const;
   uint8_t pressed() const;
   uint16_t signal(uint8_t index) const;
@@ -0,0 +1,548 @@
+#include "rules.h"
+#include <time.h>
+
+#define RULES_MAX_FIELD 31
+#define RULES_MAX_SET 8
+
+enum Op : uint8_t {
+  Op_End = 0,
+  Op_OnKey,      // key, event
+  Op_OnGroupKey, // key, event
+  Op_OnState,    // field, value
+  Op_OnCommand,  // field, value
+  Op_IfHours,    // from, to
+  Op_IfState,    // field, value
+  Op_Set,        // count, (field, value) * count
+  Op_Toggle,     // field
+  Op_After,      // seconds (u16), the remaining actions run later
+  Op_Cancel,     // rule
+};
+
+enum ValueType : uint8_t {
+  Value_Bool = 0,
+  Value_Int,    // i16
+  Value_String, // zero terminated
+};
+
+static bool emitString(std::vector<uint8_t> &code, const char *value) {
+  size_t length = value ? strlen(value) : 0;
+  if (!length || length > RULES_MAX_FIELD) {
+    return false;
+  }
+  // keep the terminator so the VM can use it directly as a JSON key
+  code.insert(code.end(), value, value + length + 1);
+  return true;
+}
+
+static bool emitValue(std::vector<uint8_t> &code, JsonVariantConst value) {
+  if (value.is<bool>()) {
+    code.push_back(Value_Bool);
+    code.push_back(value.as<bool>());
+  } else if (value.is<int16_t>()) {
+    int16_t number = value;
+    code.push_back(Value_Int);
+    code.push_back(number);
+    code.push_back(number >> 8);
+  } else if (value.is<const char *>()) {
+    code.push_back(Value_String);
+    return emitString(code, value);
+  } else {
+    return false;
+  }
+  return true;
+}
+
+static bool isWithinHours(uint8_t from, uint8_t to) {
+  time_t now = time(nullptr);
+  struct tm local;
+  localtime_r(&now, &local);
+  if (local.tm_year < 120) {
+    // clock not synchronized yet
+    return false;
+  }
+
+  if (from <= to) {
+    return local.tm_hour >= from && local.tm_hour < to;
+  }
+  return local.tm_hour >= from || local.tm_hour < to;
+}
+
+bool Rules::compile(JsonArrayConst rules) {
+  if (!_lock) {
+    _lock = xSemaphoreCreateRecursiveMutex();
+  }
+
+  std::vector<uint8_t> code;
+  std::vector<uint16_t> offsets;
+  std::vector<uint8_t> triggers[Trigger_Count];
+  String error;
+
+  if (rules.size() > RULES_MAX) {
+    error = "too many rules";
+  }
+
+  for (JsonVariantConst rule : rules) {
+    if (error.length()) {
+      break;
+    }
+
+    RuleTrigger trigger;
+    offsets.push_back(code.size());
+    if (!compileRule(code, rule.as<JsonObjectConst>(), trigger)) {
+      error = String("rule ") + (offsets.size() - 1) + ": " + _error;
+    } else if (code.size() > RULES_MAX_CODE) {
+      error = "program too large";
+    } else {
+      triggers[trigger].push_back(offsets.size() - 1);
+    }
+  }
+
+  lock();
+  for (uint8_t i = 0; i < RULES_TIMERS; i++) {
+    _timers[i].active = false;
+  }
+  _ticker.detach();
+
+  // a broken rule disables the whole program, half of an automation is
+  // worse than none
+  if (error.length()) {
+    code.clear();
+    offsets.clear();
+    for (uint8_t i = 0; i < Trigger_Count; i++) {
+      triggers[i].clear();
+    }
+  }
+
+  _code.swap(code);
+  _offsets.swap(offsets);
+  for (uint8_t i = 0; i < Trigger_Count; i++) {
+    _triggers[i].swap(triggers[i]);
+  }
+  _matched.assign(_offsets.size(), false);
+  _error = error;
+  unlock();
+
+  return !error.length();
+}
+
+bool Rules::compileRule(std::vector<uint8_t> &code, JsonObjectConst rule,
+                        RuleTrigger &trigger) {
+  return compileTrigger(code, rule["on"], trigger) &&
+         compileConditions(code, rule["if"]) &&
+         compileActions(code, rule["do"]);
+}
+
+bool Rules::compileTrigger(std::vector<uint8_t> &code, JsonObjectConst on,
+                           RuleTrigger &trigger) {
+  bool isGroupKey = on["groupKey"].is<uint8_t>();
+  if (on["key"].is<uint8_t>() || isGroupKey) {
+    uint8_t key = isGroupKey ? on["groupKey"] : on["key"];
+    String event = on["event"] | "down";
+
+    uint8_t keyEvent;
+    if (event == "down") {
+      keyEvent = RuleKey_Down;
+    } else if (event == "up") {
+      keyEvent = RuleKey_Up;
+    } else if (event == "long") {
+      keyEvent = RuleKey_Long;
+    } else {
+      _error = "unknown key event";
+      return false;
+    }
+
+    trigger = isGroupKey ? Trigger_GroupKey : Trigger_Key;
+    code.push_back(isGroupKey ? Op_OnGroupKey : Op_OnKey);
+    code.push_back(key);
+    code.push_back(keyEvent);
+    return true;
+  }
+
+  JsonObjectConst match;
+  if (on["state"].is<JsonObjectConst>()) {
+    trigger = Trigger_State;
+    match = on["state"];
+    code.push_back(Op_OnState);
+  } else if (on["command"].is<JsonObjectConst>()) {
+    trigger = Trigger_Command;
+    match = on["command"];
+    code.push_back(Op_OnCommand);
+  } else {
+    _error = "unknown trigger";
+    return false;
+  }
+
+  if (match.size() != 1) {
+    _error = "trigger needs exactly one field";
+    return false;
+  }
+
+  for (JsonPairConst field : match) {
+    if (!emitString(code, field.key().c_str()) ||
+        !emitValue(code, field.value())) {
+      _error = "invalid trigger field";
+      return false;
+    }
+  }
+  return true;
+}
+
+bool Rules::compileConditions(std::vector<uint8_t> &code,
+                              JsonObjectConst when) {
+  if (when.isNull()) {
+    return true;
+  }
+
+  auto hours = when["hours"];
+  if (!hours.isNull()) {
+    int from = hours[0] | -1;
+    int to = hours[1] | -1;
+    if (from < 0 || from > 24 || to < 0 || to > 24) {
+      _error = "invalid hours";
+      return false;
+    }
+    code.push_back(Op_IfHours);
+    code.push_back(from);
+    code.push_back(to);
+  }
+
+  for (JsonPairConst field : when["state"].as<JsonObjectConst>()) {
+    code.push_back(Op_IfState);
+    if (!emitString(code, field.key().c_str()) ||
+        !emitValue(code, field.value())) {
+      _error = "invalid state condition";
+      return false;
+    }
+  }
+  return true;
+}
+
+bool Rules::compileActions(std::vector<uint8_t> &code,
+                           JsonArrayConst actions) {
+  if (!actions.size()) {
+    _error = "no actions";
+    return false;
+  }
+
+  for (JsonVariantConst item : actions) {
+    JsonObjectConst action = item.as<JsonObjectConst>();
+
+    if (action["set"].is<JsonObjectConst>()) {
+      JsonObjectConst set = action["set"];
+      if (!set.size() || set.size() > RULES_MAX_SET) {
+        _error = "invalid set";
+        return false;
+      }
+      code.push_back(Op_Set);
+      code.push_back(set.size());
+      for (JsonPairConst field : set) {
+        if (!emitString(code, field.key().c_str()) ||
+            !emitValue(code, field.value())) {
+          _error = "invalid set field";
+          return false;
+        }
+      }
+    } else if (action["toggle"].is<const char *>()) {
+      code.push_back(Op_Toggle);
+      if (!emitString(code, action["toggle"])) {
+        _error = "invalid toggle field";
+        return false;
+      }
+    } else if (action["after"].is<uint16_t>()) {
+      uint16_t seconds = action["after"];
+      code.push_back(Op_After);
+      code.push_back(seconds);
+      code.push_back(seconds >> 8);
+    } else if (action["cancel"].is<uint8_t>()) {
+      code.push_back(Op_Cancel);
+      code.push_back(action["cancel"].as<uint8_t>());
+    } else {
+      _error = "unknown action";
+      return false;
+    }
+  }
+
+  code.push_back(Op_End);
+  return true;
+}
+
+const char *Rules::readField(uint16_t &pc) const {
+  const char *field = (const char *)&_code[pc];
+  pc += strlen(field) + 1;
+  return field;
+}
+
+void Rules::readValue(uint16_t &pc, JsonDocument &doc,
+                      const char *field) const {
+  switch (_code[pc++]) {
+  case Value_Bool:
+    doc[field] = _code[pc++] != 0;
+    break;
+  case Value_Int:
+    doc[field] = (int16_t)(_code[pc] | _code[pc + 1] << 8);
+    pc += 2;
+    break;
+  case Value_String:
+    doc[field] = readField(pc);
+    break;
+  }
+}
+
+bool Rules::matchValue(uint16_t &pc, JsonVariantConst actual) const {
+  switch (_code[pc++]) {
+  case Value_Bool: {
+    bool expected = _code[pc++] != 0;
+    return actual.is<bool>() && actual.as<bool>() == expected;
+  }
+  case Value_Int: {
+    int16_t expected = _code[pc] | _code[pc + 1] << 8;
+    pc += 2;
+    return actual.is<int>() && actual.as<int>() == expected;
+  }
+  case Value_String: {
+    const char *expected = readField(pc);
+    return actual.is<const char *>() &&
+           !strcmp(actual.as<const char *>(), expected);
+  }
+  }
+  return false;
+}
+
+void Rules::lock() {
+  if (_lock) {
+    xSemaphoreTakeRecursive(_lock, portMAX_DELAY);
+  }
+}
+
+void Rules::unlock() {
+  if (_lock) {
+    xSemaphoreGiveRecursive(_lock);
+  }
+}
+
+void Rules::handleKey(int8_t key, uint8_t event) {
+  handleKeyTrigger(Trigger_Key, key, event);
+}
+
+void Rules::handleGroupKey(int8_t key, uint8_t event) {
+  handleKeyTrigger(Trigger_GroupKey, key, event);
+}
+
+void Rules::handleKeyTrigger(RuleTrigger trigger, int8_t key, uint8_t event) {
+  RuleUpdates updates;
+  lock();
+  for (uint8_t rule : _triggers[trigger]) {
+    uint16_t pc = _offsets[rule] + 1;
+    if (_code[pc] == key && _code[pc + 1] == event) {
+      fire(rule, pc + 2, updates);
+    }
+  }
+  unlock();
+  apply(updates);
+}
+
+void Rules::handleState(JsonVariantConst state) {
+  RuleUpdates updates;
+  lock();
+  for (uint8_t rule : _triggers[Trigger_State]) {
+    uint16_t pc = _offsets[rule] + 1;
+    const char *field = readField(pc);
+    bool matched = matchValue(pc, state[field]);
+
+    // state triggers fire on the edge, not on every publish
+    bool wasMatched = _matched[rule];
+    _matched[rule] = matched;
+    if (matched && !wasMatched) {
+      fire(rule, pc, updates);
+    }
+  }
+  unlock();
+  apply(updates);
+}
+
+void Rules::handleCommand(JsonVariantConst command) {
+  RuleUpdates updates;
+  lock();
+  for (uint8_t rule : _triggers[Trigger_Command]) {
+    uint16_t pc = _offsets[rule] + 1;
+    const char *field = readField(pc);
+    if (matchValue(pc, command[field])) {
+      fire(rule, pc, updates);
+    }
+  }
+  unlock();
+  apply(updates);
+}
+
+void Rules::fire(uint8_t rule, uint16_t pc, RuleUpdates &updates) {
+  JsonDocument state;
+  bool hasState = false;
+
+  while (true) {
+    uint8_t op = _code[pc];
+    if (op == Op_IfHours) {
+      if (!isWithinHours(_code[pc + 1], _code[pc + 2])) {
+        return;
+      }
+      pc += 3;
+    } else if (op == Op_IfState) {
+      pc++;
+      if (!hasState && _getState) {
+        _getState(state);
+        hasState = true;
+      }
+      const char *field = readField(pc);
+      if (!matchValue(pc, state[field])) {
+        return;
+      }
+    } else {
+      break;
+    }
+  }
+
+  _fired++;
+  run(rule, pc, state, hasState, updates);
+}
+
+void Rules::run(uint8_t rule, uint16_t pc, JsonDocument &state,
+                bool &hasState, RuleUpdates &updates) {
+  JsonDocument update;
+  bool done = false;
+
+  while (!done) {
+    switch (_code[pc++]) {
+    case Op_Set: {
+      uint8_t count = _code[pc++];
+      for (uint8_t i = 0; i < count; i++) {
+        const char *field = readField(pc);
+        readValue(pc, update, field);
+      }
+      break;
+    }
+    case Op_Toggle: {
+      const char *field = readField(pc);
+      if (!hasState && _getState) {
+        _getState(state);
+        hasState = true;
+      }
+      update[field] = !state[field].as<bool>();
+      break;
+    }
+    case Op_After: {
+      uint16_t seconds = _code[pc] | _code[pc + 1] << 8;
+      pc += 2;
+      schedule(rule, pc, seconds * 1000);
+      done = true;
+      break;
+    }
+    case Op_Cancel:
+      cancel(_code[pc++]);
+      break;
+    default:
+      done = true;
+      break;
+    }
+  }
+
+  if (update.size()) {
+    updates.push_back(std::move(update));
+  }
+}
+
+void Rules::apply(RuleUpdates &updates) {
+  // called without the lock held, applying publishes the state which takes
+  // the MQTT client lock and feeds back into handleState
+  if (!_apply) {
+    return;
+  }
+  for (JsonDocument &update : updates) {
+    _apply(update);
+  }
+}
+
+void Rules::schedule(uint8_t rule, uint16_t pc, uint32_t delayMs) {
+  // re-triggering restarts the countdown, e.g. "off after 5 minutes"
+  cancel(rule);
+
+  for (uint8_t i = 0; i < RULES_TIMERS; i++) {
+    if (!_timers[i].active) {
+      _timers[i].active = true;
+      _timers[i].rule = rule;
+      _timers[i].pc = pc;
+      _timers[i].deadline = millis() + delayMs;
+      break;
+    }
+  }
+  armTimer();
+}
+
+void Rules::cancel(uint8_t rule) {
+  for (uint8_t i = 0; i < RULES_TIMERS; i++) {
+    if (_timers[i].rule == rule) {
+      _timers[i].active = false;
+    }
+  }
+}
+
+void Rules::armTimer() {
+  auto now = millis();
+  bool hasTimer = false;
+  int32_t nearest = INT32_MAX;
+
+  for (uint8_t i = 0; i < RULES_TIMERS; i++) {
+    if (_timers[i].active) {
+      hasTimer = true;
+      nearest = min(nearest, (int32_t)(_timers[i].deadline - now));
+    }
+  }
+
+  if (hasTimer) {
+    _ticker.once_ms(max<int32_t>(1, nearest), Rules::handleTimers, this);
+  } else {
+    _ticker.detach();
+  }
+}
+
+void Rules::handleTimers(Rules *instance) {
+  Rules &me = *instance;
+  RuleUpdates updates;
+  me.lock();
+
+  auto now = millis();
+  for (uint8_t i = 0; i < RULES_TIMERS; i++) {
+    RuleTimer &timer = me._timers[i];
+    if (timer.active && (int32_t)(now - timer.deadline) >= 0) {
+      timer.active = false;
+
+      JsonDocument state;
+      bool hasState = false;
+      me.run(timer.rule, timer.pc, state, hasState, updates);
+    }
+  }
+
+  me.armTimer();
+  me.unlock();
+  me.apply(updates);
+}
+
+void Rules::onApply(RuleApplyHandler handler) { _apply = handler; }
+
+void Rules::onGetState(RuleGetStateHandler handler) { _getState = handler; }
+
+void Rules::appendStatus(JsonVariant doc) const {
+  doc["count"] = _offsets.size();
+  doc["bytes"] = _code.size();
+  doc["fired"] = _fired;
+
+  uint8_t timers = 0;
+  for (uint8_t i = 0; i < RULES_TIMERS; i++) {
+    if (_timers[i].active) {
+      timers++;
+    }
+  }
+  doc["timers"] = timers;
+
+  if (_error.length()) {
+    doc["error"] = _error;
+  }
+}
@@ -0,0 +1,91 @@
+#ifndef _RULES_H_
+#define _RULES_H_
+
+#include "timers.h"
+#include <ArduinoJson.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#include <vector>
+
+#define RULES_MAX 32
+#define RULES_TIMERS 8
+#define RULES_MAX_CODE 2048
+
+enum RuleTrigger {
+  Trigger_Key = 0,
+  Trigger_GroupKey,
+  Trigger_State,
+  Trigger_Command,
+  Trigger_Count,
+};
+
+// same values as KeyEvent and GroupTouchEvent
+enum RuleKeyEvent {
+  RuleKey_Down = 0,
+  RuleKey_Up,
+  RuleKey_Long,
+};
+
+typedef std::function<void(JsonVariant state)> RuleApplyHandler;
+typedef std::function<void(JsonVariant state)> RuleGetStateHandler;
+typedef std::vector<JsonDocument> RuleUpdates;
+
+struct RuleTimer {
+  bool active;
+  uint8_t rule;
+  uint16_t pc;
+  uint32_t deadline;
+};
+
+// rules from the config compiled into bytecode, every event only walks the
+// rules registered for its trigger type
+class Rules {
+  std::vector<uint8_t> _code;
+  std::vector<uint16_t> _offsets;
+  std::vector<uint8_t> _triggers[Trigger_Count];
+  std::vector<bool> _matched;
+  RuleTimer _timers[RULES_TIMERS] = {};
+  Timer _ticker{"rules"};
+  SemaphoreHandle_t _lock = nullptr;
+  RuleApplyHandler _apply;
+  RuleGetStateHandler _getState;
+  String _error;
+  uint32_t _fired = 0;
+
+  bool compileRule(std::vector<uint8_t> &code, JsonObjectConst rule,
+                   RuleTrigger &trigger);
+  bool compileTrigger(std::vector<uint8_t> &code, JsonObjectConst on,
+                      RuleTrigger &trigger);
+  bool compileConditions(std::vector<uint8_t> &code, JsonObjectConst when);
+  bool compileActions(std::vector<uint8_t> &code, JsonArrayConst actions);
+
+  const char *readField(uint16_t &pc) const;
+  void readValue(uint16_t &pc, JsonDocument &doc, const char *field) const;
+  bool matchValue(uint16_t &pc, JsonVariantConst actual) const;
+
+  void lock();
+  void unlock();
+  void handleKeyTrigger(RuleTrigger trigger, int8_t key, uint8_t event);
+  void fire(uint8_t rule, uint16_t pc, RuleUpdates &updates);
+  void run(uint8_t rule, uint16_t pc, JsonDocument &state, bool &hasState,
+           RuleUpdates &updates);
+  void apply(RuleUpdates &updates);
+  void schedule(uint8_t rule, uint16_t pc, uint32_t delayMs);
+  void cancel(uint8_t rule);
+  void armTimer();
+  static void handleTimers(Rules *instance);
+
+public:
+  bool compile(JsonArrayConst rules);
+  void onApply(RuleApplyHandler handler);
+  void onGetState(RuleGetStateHandler handler);
+
+  void handleKey(int8_t key, uint8_t event);
+  void handleGroupKey(int8_t key, uint8_t event);
+  void handleState(JsonVariantConst state);
+  void handleCommand(JsonVariantConst command);
+
+  void appendStatus(JsonVariant doc) const;
+};
+
+#endif
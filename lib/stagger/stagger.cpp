@@ -0,0 +1,15 @@
+#include "stagger.h"
+
+void Stagger::setGap(uint32_t gap) { _gap = gap; }
+
+uint32_t Stagger::reserve() {
+  uint32_t now = millis();
+  if (!_gap || (int32_t)(now - _next) >= 0) {
+    _next = now + _gap;
+    return 0;
+  }
+
+  uint32_t wait = _next - now;
+  _next += _gap;
+  return wait;
+}
@@ -0,0 +1,17 @@
+#ifndef _STAGGER_H_
+#define _STAGGER_H_
+
+#include <Arduino.h>
+
+// spaces out starts that would otherwise happen at the same time
+class Stagger {
+  uint32_t _gap = 0;
+  uint32_t _next = 0;
+
+public:
+  void setGap(uint32_t gap);
+  // takes the next free slot, returns how long to wait for it
+  uint32_t reserve();
+};
+
+#endif
@@ -0,0 +1,123 @@
+#include "state-store.h"
+#include "esp32/rom/crc.h"
+#include "util.h"
+
+#define STATE_MAGIC 0x53544D50
+#define NVS_KEY "state"
+#define NVS_SETTLE_TIME SECS(2)
+#define NVS_MIN_INTERVAL SECS(30)
+
+struct RtcState {
+  uint32_t magic;
+  uint32_t crc;
+  uint16_t length;
+  char data[STATE_MAX_SIZE];
+};
+
+// survives software resets, watchdogs and brownouts, but not power loss
+RTC_NOINIT_ATTR static RtcState rtcState;
+
+static uint32_t checksum(const char *data, uint16_t length) {
+  return crc32_le(0, (const uint8_t *)data, length);
+}
+
+static bool isRtcStateValid() {
+  return rtcState.magic == STATE_MAGIC && rtcState.length <= STATE_MAX_SIZE &&
+         rtcState.crc == checksum(rtcState.data, rtcState.length);
+}
+
+void StateStore::begin() {
+  _preferences.begin("ha-state");
+
+  size_t length = _preferences.getBytesLength(NVS_KEY);
+  if (length && length <= STATE_MAX_SIZE) {
+    char data[STATE_MAX_SIZE];
+    _preferences.getBytes(NVS_KEY, data, length);
+    _nvsCrc = checksum(data, length);
+  }
+}
+
+bool StateStore::restore(JsonDocument &state) {
+  if (isRtcStateValid() &&
+      deserializeMsgPack(state, rtcState.data, rtcState.length) ==
+          DeserializationError::Code::Ok) {
+    _restoredFrom = State_Rtc;
+    return true;
+  }
+
+  size_t length = _preferences.getBytesLength(NVS_KEY);
+  if (length && length <= STATE_MAX_SIZE) {
+    _preferences.getBytes(NVS_KEY, rtcState.data, length);
+    rtcState.length = length;
+    rtcState.crc = checksum(rtcState.data, length);
+    rtcState.magic = STATE_MAGIC;
+
+    if (deserializeMsgPack(state, rtcState.data, length) ==
+        DeserializationError::Code::Ok) {
+      _restoredFrom = State_Nvs;
+      return true;
+    }
+    rtcState.magic = 0;
+  }
+
+  return false;
+}
+
+void StateStore::save(JsonVariantConst state) {
+  if (measureMsgPack(state) > STATE_MAX_SIZE) {
+    _dropped++;
+    return;
+  }
+
+  rtcState.magic = 0;
+  rtcState.length = serializeMsgPack(state, rtcState.data, STATE_MAX_SIZE);
+  rtcState.crc = checksum(rtcState.data, rtcState.length);
+  rtcState.magic = STATE_MAGIC;
+
+  if (rtcState.crc == _nvsCrc) {
+    return;
+  }
+
+  // NVS already spreads writes over its pages; settle bursts (blinds moving,
+  // dimmer fades) and cap the write rate on top of that
+  uint32_t delayMs = NVS_SETTLE_TIME;
+  if (_lastFlush) {
+    int32_t untilAllowed = _lastFlush + NVS_MIN_INTERVAL - millis();
+    if (untilAllowed > (int32_t)delayMs) {
+      delayMs = untilAllowed;
+    }
+  }
+  _flushTicker.once_ms(delayMs, StateStore::flush, this);
+}
+
+void StateStore::flush(StateStore *instance) {
+  StateStore &me = *instance;
+  if (!isRtcStateValid() || rtcState.crc == me._nvsCrc) {
+    return;
+  }
+
+  if (me._preferences.putBytes(NVS_KEY, rtcState.data, rtcState.length)) {
+    me._nvsCrc = rtcState.crc;
+    me._nvsWrites++;
+  }
+  me._lastFlush = millis();
+}
+
+void StateStore::appendStatus(JsonVariant doc) const {
+  auto status = doc["stateStore"].to<JsonObject>();
+  switch (_restoredFrom) {
+  case State_Rtc:
+    status["restored"] = "rtc";
+    break;
+  case State_Nvs:
+    status["restored"] = "nvs";
+    break;
+  default:
+    status["restored"] = "none";
+    break;
+  }
+  status["nvsWrites"] = _nvsWrites;
+  if (_dropped) {
+    status["dropped"] = _dropped;
+  }
+}
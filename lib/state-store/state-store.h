@@ -0,0 +1,32 @@
+#ifndef _STATE_STORE_H_
+#define _STATE_STORE_H_
+
+#include "timers.h"
+#include <ArduinoJson.h>
+#include <Preferences.h>
+
+// fits blinds with every motor moving, stored as MessagePack
+#define STATE_MAX_SIZE 1024
+
+enum StateSource { State_None = 0, State_Rtc, State_Nvs };
+
+class StateStore {
+  Preferences _preferences;
+  Timer _flushTicker{"state-flush"};
+  StateSource _restoredFrom = State_None;
+  uint32_t _lastFlush = 0;
+  uint32_t _nvsCrc = 0;
+  uint32_t _nvsWrites = 0;
+  // states too large to be kept
+  uint32_t _dropped = 0;
+
+  static void flush(StateStore *instance);
+
+public:
+  void begin();
+  bool restore(JsonDocument &state);
+  void save(JsonVariantConst state);
+  void appendStatus(JsonVariant doc) const;
+};
+
+#endif
@@ -1,8 +1,8 @@
 #ifndef _SWITCH_BASE_H_
 #define _SWITCH_BASE_H_
 
+#include "timers.h"
 #include <ArduinoJson.h>
-#include <Ticker.h>
 
 typedef std::function<void()> StateChangedHandler;
 
@@ -11,7 +11,7 @@ private:
   StateChangedHandler _handler;
   uint8_t _suspendStateChanges;
   bool _pendingChanges;
-  Ticker _throttle;
+  Timer _throttle{"state-throttle"};
   uint32_t _lastSend;
 
 protected:
@@ -0,0 +1,545 @@
+#include "blinds-motor.h"
+#include "latency.h"
+#include "metrics.h"
+#include <climits>
+
+#define SAFETY_DELTA SECS(1)
+#define NO_TARGET INT_MIN
+
+// relays can't switch shorter pulses reliably
+#define TILT_MIN_PULSE MSEC(20)
+#define NO_TILT -1
+
+static_assert(CONFIG_TRAVEL_SEGMENTS == TRAVEL_SEGMENTS,
+              "config and travel model segments differ");
+
+BlindsMotor::BlindsMotor() : _afterRehome(NO_TARGET), _restoreTilt(NO_TILT) {}
+
+void BlindsMotor::configure(const BlindsMotorConfig &config,
+                            const BlindsConfig &common, Stagger &stagger) {
+  if (_pinOpen != config.open || _pinClose != config.close) {
+    // the position is kept, the motor is stopped on the old pins
+    end();
+  }
+
+  if (!_initialized) {
+    _pinOpen = config.open;
+    _pinClose = config.close;
+
+    if (_pinOpen != -1) {
+      pinMode(_pinOpen, OUTPUT);
+      digitalWrite(_pinOpen, LOW);
+    }
+
+    if (_pinClose != -1) {
+      pinMode(_pinClose, OUTPUT);
+      digitalWrite(_pinClose, LOW);
+    }
+
+    if (!_timer) {
+      esp_timer_create_args_t args = {};
+      args.callback = BlindsMotor::handleTimer;
+      args.arg = this;
+      args.name = "blinds";
+      esp_timer_create(&args, &_timer);
+    }
+    _initialized = true;
+  }
+
+  _stagger = &stagger;
+  _delayAfterOff = common.delay;
+  _progressInterval = common.progressInterval;
+
+  _tiltMs[Travel_Open] = config.tiltOpen;
+  _tiltMs[Travel_Close] = config.tiltClose;
+
+  _maxPosition = config.travel;
+  if (config.hasCurve) {
+    _travel.setSegments(config.travel, config.openCurve, config.closeCurve);
+  } else {
+    _travel.setLinear(config.travel, config.travel,
+                      config.travel - min(config.openCloseDelta,
+                                          config.travel / 2));
+  }
+}
+
+void BlindsMotor::end() {
+  if (!_initialized) {
+    return;
+  }
+
+  changeMotor(Motor_Off);
+  // the relays are off already, nothing is left to wait for
+  _ticker.detach();
+  esp_timer_stop(_timer);
+  _motorState = _pendingState = Motor_Off;
+  _startReserved = false;
+  _calibration = Calibration_Off;
+  _afterRehome = NO_TARGET;
+  _restoreTilt = NO_TILT;
+  _tilting = false;
+
+  if (_pinOpen != -1) {
+    pinMode(_pinOpen, INPUT);
+  }
+  if (_pinClose != -1) {
+    pinMode(_pinClose, INPUT);
+  }
+
+  _initialized = false;
+}
+
+void BlindsMotor::changeMotor(MotorState newState) {
+  if (_motorState == Motor_DeadTime) {
+    // started once the relays had time to settle
+    _pendingState = newState;
+    if (newState == Motor_Off) {
+      _targetPosition = _position;
+    }
+    return;
+  }
+
+  if (newState == _motorState) {
+    return;
+  }
+
+  if (_motorState != Motor_Off) {
+    digitalWrite(_pinOpen, LOW);
+    digitalWrite(_pinClose, LOW);
+    uint32_t ran = millis() - _motorChange;
+    Metrics::count(Metric_BlindsMotorMs, ran);
+    trackTilt(ran);
+    if (_tilting) {
+      // slats turn in place, the position stays
+      _tilting = false;
+    } else {
+      _position = getCurrentPosition(true);
+      trackError(ran);
+    }
+
+    if (_delayAfterOff) {
+      _motorState = Motor_DeadTime;
+      _ticker.detach();
+      armTimer(_delayAfterOff);
+      changeMotor(newState);
+      changed();
+      return;
+    }
+    _motorState = Motor_Off;
+  }
+
+  uint32_t wait = newState != Motor_Off ? _stagger->reserve() : 0;
+  if (wait) {
+    // another motor just started, wait for the next slot
+    _motorState = Motor_DeadTime;
+    _pendingState = newState;
+    _startReserved = true;
+    armTimer(wait);
+    changed();
+    return;
+  }
+
+  startMotor(newState);
+}
+
+void BlindsMotor::startMotor(MotorState newState) {
+  _motorState = newState;
+
+  if (_motorState == Motor_Off) {
+    _targetPosition = _position;
+    _tilting = false;
+    _ticker.detach();
+    esp_timer_stop(_timer);
+  } else {
+    digitalWrite(_motorState == Motor_Opening ? _pinOpen : _pinClose, HIGH);
+    _motorChange = millis();
+    _lastDirection = _motorState;
+    CommandLatency::applied();
+    scheduleStop();
+    if (_progressInterval) {
+      _ticker.attach_ms(_progressInterval, BlindsMotor::handle, this);
+    }
+  }
+
+  // the motion in the state lets clients interpolate until the stop
+  changed();
+}
+
+void BlindsMotor::scheduleStop() {
+  if (_tilting) {
+    armTimer(_pulseMs);
+    return;
+  }
+
+  int current = getCurrentPosition();
+  bool ahead = _motorState == Motor_Closing ? _targetPosition > current
+                                            : _targetPosition < current;
+  armTimer(ahead ? _travel.timeTo(current, _targetPosition) : 0);
+}
+
+void BlindsMotor::armTimer(uint32_t ms) {
+  esp_timer_stop(_timer);
+  esp_timer_start_once(_timer, (uint64_t)ms * 1000);
+}
+
+bool BlindsMotor::isMoving() const {
+  return _motorState == Motor_Opening || _motorState == Motor_Closing ||
+         _pendingState != Motor_Off;
+}
+
+void BlindsMotor::trackError(uint32_t ran) {
+  // overdriven into an end stop, the position is exact again
+  if ((_targetPosition < 0 && _position == 0) ||
+      (_targetPosition > _maxPosition && _position == _maxPosition)) {
+    _travelError.homed();
+    return;
+  }
+  _travelError.ran(ran);
+}
+
+void BlindsMotor::trackTilt(uint32_t ran) {
+  // any run turns the slats towards its direction first
+  bool closing = _motorState == Motor_Closing;
+  uint16_t tiltMs = _tiltMs[closing ? Travel_Close : Travel_Open];
+  if (!tiltMs) {
+    return;
+  }
+  int change = min<uint32_t>(ran, tiltMs) * 100 / tiltMs;
+  _tilt = constrain(_tilt + (closing ? -change : change), 0, 100);
+}
+
+void BlindsMotor::setTilt(int tilt) {
+  if (!_tiltMs[Travel_Open] || !_tiltMs[Travel_Close] ||
+      _calibration != Calibration_Off) {
+    return;
+  }
+
+  tilt = constrain(tilt, 0, 100);
+  if (isMoving()) {
+    // turned once the move is done
+    _restoreTilt = tilt;
+    return;
+  }
+
+  MotorState direction = tilt < _tilt ? Motor_Closing : Motor_Opening;
+  uint32_t pulse = abs(tilt - _tilt) *
+                   _tiltMs[direction == Motor_Closing ? Travel_Close
+                                                      : Travel_Open] /
+                   100;
+  if (pulse < TILT_MIN_PULSE) {
+    return;
+  }
+
+  _pulseMs = pulse;
+  _tilting = true;
+  changeMotor(direction);
+}
+
+void BlindsMotor::moveEnded() {
+  if (_calibration == Calibration_Homing) {
+    _calibration = Calibration_Closing;
+    _marks = 0;
+    calibrationMove(Motor_Closing);
+  } else if (_calibration != Calibration_Off) {
+    // ran far past the expected travel without all marks
+    _calibration = Calibration_Off;
+  } else if (_afterRehome != NO_TARGET) {
+    setTargetPosition(_afterRehome, false);
+  } else if (_restoreTilt != NO_TILT) {
+    int tilt = _restoreTilt;
+    _restoreTilt = NO_TILT;
+    setTilt(tilt);
+  }
+}
+
+void BlindsMotor::startCalibration() {
+  // assume it is closed and drive the full travel up into the end stop
+  _afterRehome = NO_TARGET;
+  changeMotor(Motor_Off);
+  _calibration = Calibration_Homing;
+  _position = _maxPosition;
+  _targetPosition = -SAFETY_DELTA;
+  changeMotor(Motor_Opening);
+}
+
+void BlindsMotor::calibrationMove(MotorState direction) {
+  // far past the end, the marks stop the motor and the timer is a timeout
+  _targetPosition =
+      direction == Motor_Closing ? _maxPosition * 3 : -_maxPosition * 2;
+  changeMotor(direction);
+}
+
+void BlindsMotor::markCalibration() {
+  if (_calibration == Calibration_Homing) {
+    _calibration = Calibration_Off;
+    changeMotor(Motor_Off);
+    return;
+  }
+
+  bool closing = _calibration == Calibration_Closing;
+  if (_motorState != (closing ? Motor_Closing : Motor_Opening)) {
+    // still in the dead time
+    return;
+  }
+
+  // one mark per segment boundary, opening passes them from the closed end
+  uint32_t now = millis();
+  uint8_t index = closing ? _marks : TRAVEL_SEGMENTS - 1 - _marks;
+  _measured[closing ? Travel_Close : Travel_Open][index] =
+      now - (_marks ? _lastMark : _motorChange);
+  _lastMark = now;
+  if (++_marks < TRAVEL_SEGMENTS) {
+    return;
+  }
+
+  changeMotor(Motor_Off);
+  _marks = 0;
+  if (closing) {
+    _position = _maxPosition;
+    _calibration = Calibration_Opening;
+    calibrationMove(Motor_Opening);
+    return;
+  }
+
+  _position = _targetPosition = 0;
+  _travelError.homed();
+  _calibration = Calibration_Off;
+  _travel.setSegments(_maxPosition, _measured[Travel_Open],
+                      _measured[Travel_Close]);
+  if (_calibrated) {
+    _calibrated(_measured[Travel_Open], _measured[Travel_Close]);
+  }
+}
+
+void BlindsMotor::onCalibrated(BlindsCalibratedHandler handler) {
+  _calibrated = handler;
+}
+
+void BlindsMotor::onChanged(StateChangedHandler handler) {
+  _changed = handler;
+}
+
+MotorState BlindsMotor::motorState() const { return _motorState; }
+
+bool BlindsMotor::isCalibrating() const {
+  return _calibration != Calibration_Off;
+}
+
+void BlindsMotor::open() { setTargetPosition(0, true); }
+
+void BlindsMotor::close() { setTargetPosition(_maxPosition, true); }
+
+void BlindsMotor::stop() {
+  _afterRehome = NO_TARGET;
+  _restoreTilt = NO_TILT;
+  changeMotor(Motor_Off);
+}
+
+void BlindsMotor::toggle() {
+  // at an end there is only one way to go
+  if (_position >= _maxPosition ||
+      (_position > 0 && _lastDirection == Motor_Closing)) {
+    open();
+  } else {
+    close();
+  }
+}
+
+int BlindsMotor::getCurrentPosition(bool limit) const {
+  if (_motorState == Motor_Off || _motorState == Motor_DeadTime || _tilting) {
+    return _position;
+  }
+
+  int currentPosition =
+      _travel.advance(_position,
+                      _motorState == Motor_Closing ? Travel_Close : Travel_Open,
+                      millis() - _motorChange);
+  if (limit) {
+    if (currentPosition < 0) {
+      currentPosition = 0;
+    } else if (currentPosition > _maxPosition) {
+      currentPosition = _maxPosition;
+    }
+  }
+  return currentPosition;
+}
+
+void BlindsMotor::handle(BlindsMotor *instance) {
+  // stops are scheduled exactly, this only reports progress when enabled
+  MetricScope scope(Callback_Blinds);
+  instance->changed();
+}
+
+void BlindsMotor::handleTimer(void *instance) {
+  MetricScope scope(Callback_Blinds);
+  BlindsMotor &me = *(BlindsMotor *)instance;
+
+  if (me._motorState == Motor_DeadTime) {
+    MotorState next = me._pendingState;
+    if (next != Motor_Off && !me._startReserved) {
+      uint32_t wait = me._stagger->reserve();
+      if (wait) {
+        me._startReserved = true;
+        me.armTimer(wait);
+        return;
+      }
+    }
+    me._startReserved = false;
+    me._pendingState = Motor_Off;
+    me.startMotor(next);
+  } else if (me._motorState != Motor_Off) {
+    me.changeMotor(Motor_Off);
+    // also after a tilt pulse, a tilt that came in meanwhile is applied now
+    me.moveEnded();
+  }
+}
+
+void BlindsMotor::changed() {
+  if (_changed) {
+    _changed();
+  }
+}
+
+void BlindsMotor::setTargetPosition(int target, bool addSafetyMargin) {
+  if (target <= 0) {
+    target = addSafetyMargin ? -SAFETY_DELTA : 0;
+  }
+  if (target >= _maxPosition) {
+    target = _maxPosition + (addSafetyMargin ? SAFETY_DELTA : 0);
+  }
+
+  if (_targetPosition == target) {
+    return;
+  }
+
+  _afterRehome = NO_TARGET;
+  _tilting = false;
+  if (_tiltMs[Travel_Open] && _tiltMs[Travel_Close] &&
+      _restoreTilt == NO_TILT && target > 0 &&
+      target < _maxPosition) {
+    // venetian slats end up turned by the move, turn them back afterwards
+    _restoreTilt = _tilt;
+  }
+  if (target > 0 && target < _maxPosition && !isMoving() &&
+      _travelError.needsRehome(_maxPosition)) {
+    // drift adds up over partial moves, start from the nearer end stop
+    _afterRehome = target;
+    target = getCurrentPosition() < _maxPosition / 2
+                 ? -SAFETY_DELTA
+                 : _maxPosition + SAFETY_DELTA;
+  }
+
+  _targetPosition = target;
+
+  if (getCurrentPosition() < _targetPosition) {
+    changeMotor(Motor_Closing);
+  } else if (getCurrentPosition() > _targetPosition) {
+    changeMotor(Motor_Opening);
+  }
+
+  if (_motorState == Motor_Opening || _motorState == Motor_Closing) {
+    // already running, the stop moves with the target
+    scheduleStop();
+  }
+}
+
+void BlindsMotor::appendState(JsonVariant doc) const {
+  if (_initialized) {
+    int openPercent = (int)(100 - _targetPosition * 100 / _maxPosition);
+    if (openPercent < 0) {
+      openPercent = 0;
+    } else if (openPercent > 100) {
+      openPercent = 100;
+    }
+
+    doc["openPercent"] = openPercent;
+    doc["target"] = _targetPosition;
+    doc["current"] = getCurrentPosition(true);
+    doc["motor"] = getMotorStatus();
+    if ((_motorState == Motor_Opening || _motorState == Motor_Closing) &&
+        !_tilting) {
+      appendMotion(doc["motion"].to<JsonObject>());
+    }
+    if (_tiltMs[Travel_Open] && _tiltMs[Travel_Close]) {
+      doc["tiltPercent"] = _tilt;
+    }
+    if (_calibration != Calibration_Off) {
+      doc["calibrating"] = true;
+    }
+  }
+}
+
+void BlindsMotor::appendMotion(JsonVariant doc) const {
+  bool closing = _motorState == Motor_Closing;
+  int current = getCurrentPosition();
+  int target = max(0, min(_targetPosition, _maxPosition));
+  uint32_t elapsed = millis() - _motorChange;
+  uint32_t eta = (closing ? target > current : target < current)
+                     ? _travel.timeTo(current, target)
+                     : 0;
+
+  doc["from"] = _position;
+  doc["target"] = target;
+  doc["direction"] = closing ? "close" : "open";
+  // positions per second averaged over the whole travel, a position is one
+  // millisecond of the configured travel time, so 1000 is the nominal speed
+  doc["speed"] = (uint64_t)_maxPosition * 1000 /
+                 _travel.travelTime(closing ? Travel_Close : Travel_Open);
+  doc["duration"] = elapsed + eta;
+  doc["eta"] = eta;
+}
+
+void BlindsMotor::updateState(JsonVariantConst state, bool isFromStoredState) {
+  if (!_initialized)
+    return;
+
+  if (isFromStoredState) {
+    if (isMoving())
+      return;
+
+    // restore state from JSON (most probably motor position hasn't changed)
+    _position = state["current"];
+    _tilt = state["tiltPercent"] | _tilt;
+    int targetPosition = state["target"];
+    setTargetPosition(targetPosition, false);
+    _restoreTilt = NO_TILT;
+  } else {
+    String calibrate = state["calibrate"] | "";
+    if (calibrate == "start") {
+      startCalibration();
+    } else if (calibrate == "mark") {
+      markCalibration();
+    } else if (calibrate == "cancel" && _calibration != Calibration_Off) {
+      _calibration = Calibration_Off;
+      changeMotor(Motor_Off);
+    }
+
+    auto stateOpenPercent = state["openPercent"];
+    if (stateOpenPercent.is<int>() && _calibration == Calibration_Off) {
+      int openPercent = stateOpenPercent;
+      setTargetPosition((100 - openPercent) * _maxPosition / 100, true);
+    }
+
+    // a tilt with a position applies after the move
+    String tilt = state["tilt"] | "";
+    if (tilt == "open" || tilt == "close") {
+      setTilt(tilt == "open" ? 100 : 0);
+    } else if (state["tiltPercent"].is<int>()) {
+      setTilt(state["tiltPercent"].as<int>());
+    }
+  }
+}
+
+String BlindsMotor::getMotorStatus() const {
+  switch (_motorState) {
+  case Motor_Off:
+  case Motor_DeadTime:
+    return "off";
+  case Motor_Opening:
+    return "open";
+  case Motor_Closing:
+    return "close";
+  default:
+    return "unknown";
+  }
+}
\ No newline at end of file
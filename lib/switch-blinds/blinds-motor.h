@@ -0,0 +1,110 @@
+#ifndef _BLINDS_MOTOR_H_
+#define _BLINDS_MOTOR_H_
+
+#include "config-model.h"
+#include "stagger.h"
+#include "switch-base.h"
+#include "timers.h"
+#include "travel-model.h"
+#include "util.h"
+#include <ArduinoJson.h>
+#include <esp_timer.h>
+
+enum MotorState {
+  Motor_Off = 0,
+  Motor_Opening,
+  Motor_Closing,
+  // relays off, waiting before the motor may start again
+  Motor_DeadTime,
+};
+
+enum CalibrationStep {
+  Calibration_Off = 0,
+  Calibration_Homing,
+  Calibration_Closing,
+  Calibration_Opening,
+};
+
+typedef std::function<void(const uint32_t *openMs, const uint32_t *closeMs)>
+    BlindsCalibratedHandler;
+
+// one open/close relay pair with its own travel model and stop timer
+class BlindsMotor {
+  bool _initialized = false;
+  int8_t _pinOpen = -1, _pinClose = -1;
+  MotorState _motorState = Motor_Off;
+  // queued while in dead time
+  MotorState _pendingState = Motor_Off;
+  MotorState _lastDirection = Motor_Closing;
+  // the pending start already has its slot in the stagger
+  bool _startReserved = false;
+  Stagger *_stagger = nullptr;
+  int _position = 0;
+  int _targetPosition = 0;
+  int _maxPosition = SECS(40);
+  TravelModel _travel;
+  TravelError _travelError;
+  int _afterRehome;
+  CalibrationStep _calibration = Calibration_Off;
+  uint8_t _marks = 0;
+  uint32_t _lastMark = 0;
+  uint32_t _measured[2][TRAVEL_SEGMENTS];
+  BlindsCalibratedHandler _calibrated;
+  // venetian slats, 0 is turned fully closed, 100 fully open
+  uint16_t _tiltMs[2] = {0, 0};
+  int _tilt = 100;
+  int _restoreTilt;
+  bool _tilting = false;
+  uint32_t _pulseMs = 0;
+  StateChangedHandler _changed;
+  uint32_t _motorChange;
+  uint16_t _delayAfterOff;
+  uint32_t _progressInterval = 0;
+  // optional progress reports while moving
+  Timer _ticker{"blinds-progress"};
+  // fires exactly at the stop or the end of the dead time
+  esp_timer_handle_t _timer = nullptr;
+  static void handle(BlindsMotor *instance);
+  static void handleTimer(void *instance);
+
+  void changed();
+  void changeMotor(MotorState newState);
+  void startMotor(MotorState newState);
+  void scheduleStop();
+  void armTimer(uint32_t ms);
+  void trackError(uint32_t ran);
+  void trackTilt(uint32_t ran);
+  void setTilt(int tilt);
+  void moveEnded();
+  void startCalibration();
+  void calibrationMove(MotorState direction);
+  int getCurrentPosition(bool limit = false) const;
+  void setTargetPosition(int target, bool addSafetyMargin);
+  String getMotorStatus() const;
+  void appendMotion(JsonVariant doc) const;
+
+public:
+  BlindsMotor();
+
+  void configure(const BlindsMotorConfig &config, const BlindsConfig &common,
+                 Stagger &stagger);
+  void end();
+
+  MotorState motorState() const;
+  bool isMoving() const;
+  bool isCalibrating() const;
+
+  void open();
+  void close();
+  void stop();
+  // reverses the last direction
+  void toggle();
+  void markCalibration();
+
+  void appendState(JsonVariant doc) const;
+  void updateState(JsonVariantConst state, bool isFromStoredState);
+  void onChanged(StateChangedHandler handler);
+  void onCalibrated(BlindsCalibratedHandler handler);
+};
+
+#endif
@@ -1,211 +1,140 @@
 #include "switch-blinds.h"
 
-#define POLL_INTERVAL MSEC(50)
-#define SAFETY_DELTA SECS(1)
-
-SwitchBlinds::SwitchBlinds(Io &io) : _io(io) {}
-
-bool SwitchBlinds::configure(const JsonVariantConst config) {
-  bool needsReboot = false;
-
-  int8_t pinOpen = config["pins"]["open"] | -1;
-  int8_t pinClose = config["pins"]["close"] | -1;
-  needsReboot = _pinOpen != pinOpen || _pinClose != pinClose;
-
-  if (!_initialized) {
-    _pinOpen = pinOpen;
-    _pinClose = pinClose;
-
-    if (_pinOpen != -1) {
-      pinMode(_pinOpen, OUTPUT);
-      digitalWrite(_pinOpen, LOW);
-    }
+SwitchBlinds::SwitchBlinds(Io &io) : _io(io) {
+  for (uint8_t i = 0; i < BLINDS_MOTORS; i++) {
+    _motors[i].onChanged([this] {
+      updateLevels();
+      raiseStateChanged();
+    });
+    _motors[i].onCalibrated(
+        [this, i](const uint32_t *openMs, const uint32_t *closeMs) {
+          if (_calibrated) {
+            _calibrated(i, openMs, closeMs);
+          }
+        });
+  }
+}
 
-    if (_pinClose != -1) {
-      pinMode(_pinClose, OUTPUT);
-      digitalWrite(_pinClose, LOW);
+void SwitchBlinds::configure(const BlindsConfig &config) {
+  _stagger.setGap(config.startGap);
+  _motorCount = config.motorCount;
+  for (uint8_t i = 0; i < BLINDS_MOTORS; i++) {
+    if (i < _motorCount) {
+      _motors[i].configure(config.motors[i], config, _stagger);
+    } else {
+      _motors[i].end();
     }
+  }
 
-    _ticker.attach_ms<SwitchBlinds *>(
-        POLL_INTERVAL, [](SwitchBlinds *me) { me->update(); }, this);
-
-    _io.onTouchDown([this](int8_t key) {
-      if (_motorState != Motor_Off) {
-        changeMotor(Motor_Off);
-      } else if (key == 1) {
-        setTargetPosition(0, true);
-      } else if (key == 2) {
-        setTargetPosition(_maxPosition, true);
-      }
-    });
+  if (!_initialized) {
+    _io.onTouchDown([this](int8_t key) { touch(key); });
     _initialized = true;
   }
 
-  _delayAfterOff = config["delay"] | 500;
-
-  auto levels = config["levels"];
-  _levelTouch = levels["touch"] | 255;
-  _levelRed = levels["red"] | 20;
-  _levelChanging = levels["changing"] | 80;
+  _levelTouch = config.touchLevel;
+  _levelRed = config.redLevel;
+  _levelChanging = config.changingLevel;
   updateLevels();
-
-  _maxPosition = config["travel"] | SECS(40);
-  _openCloseDelta = config["openCloseDelta"] | MSEC(1500);
-
-  return needsReboot;
 }
 
-void SwitchBlinds::changeMotor(MotorState newState) {
-  if (newState == _motorState) {
+void SwitchBlinds::end() {
+  if (!_initialized) {
     return;
   }
 
-  if (_motorState != Motor_Off) {
-    digitalWrite(_pinOpen, LOW);
-    digitalWrite(_pinClose, LOW);
-    _position = getCurrentPosition(true);
-    _motorState = Motor_Off;
-    updateLevels();
-
-    delay(_delayAfterOff);
-  }
-
-  _motorState = newState;
-
-  if (_motorState == Motor_Off) {
-    _targetPosition = _position;
-  } else if (_motorState == Motor_Opening) {
-    digitalWrite(_pinOpen, HIGH);
-    _motorChange = millis();
-  } else if (_motorState == Motor_Closing) {
-    digitalWrite(_pinClose, HIGH);
-    _motorChange = millis();
+  for (uint8_t i = 0; i < BLINDS_MOTORS; i++) {
+    _motors[i].end();
   }
 
-  updateLevels();
+  _io.onTouchDown(nullptr);
+  _initialized = false;
 }
 
-int SwitchBlinds::getCurrentPosition(bool limit) const {
-  if (_motorState == Motor_Off) {
-    return _position;
-  }
-
-  uint32_t now = millis();
-
-  int positionChange = now - _motorChange;
-  int8_t signOfChange;
-  if (_motorState == Motor_Closing) {
-    positionChange =
-        positionChange * _maxPosition / (_maxPosition - _openCloseDelta);
-    signOfChange = 1;
-  } else {
-    signOfChange = -1;
-  }
-
-  int currentPosition = _position + positionChange * signOfChange;
-  if (limit) {
-    if (currentPosition < 0) {
-      currentPosition = 0;
-    } else if (currentPosition > _maxPosition) {
-      currentPosition = _maxPosition;
+void SwitchBlinds::touch(int8_t key) {
+  for (uint8_t i = 0; i < _motorCount; i++) {
+    if (_motors[i].isCalibrating()) {
+      _motors[i].markCalibration();
+      return;
     }
   }
-  return currentPosition;
-}
 
-void SwitchBlinds::update() {
-  if (_motorState == Motor_Off) {
+  if (_motorCount == 1) {
+    // key 1 opens, key 2 closes, any key stops
+    BlindsMotor &motor = _motors[0];
+    if (motor.isMoving()) {
+      motor.stop();
+    } else if (key == 1) {
+      motor.open();
+    } else if (key == 2) {
+      motor.close();
+    }
     return;
   }
 
-  if (_motorState == Motor_Opening) {
-    if (getCurrentPosition() <= _targetPosition) {
-      changeMotor(Motor_Off);
-    }
+  // one key per motor, alternating direction
+  if (key < 0 || key >= _motorCount) {
+    return;
   }
-
-  if (_motorState == Motor_Closing) {
-    if (getCurrentPosition() >= _targetPosition) {
-      changeMotor(Motor_Off);
-    }
+  BlindsMotor &motor = _motors[key];
+  if (motor.isMoving()) {
+    motor.stop();
+  } else {
+    motor.toggle();
   }
-
-  raiseStateChanged();
 }
 
 void SwitchBlinds::updateLevels() {
-  _io.setLedLevels(0, _motorState == Motor_Opening ? _levelChanging : 0,
-                   _motorState == Motor_Closing ? _levelChanging : 0,
-                   _levelTouch, _levelRed);
-}
-
-void SwitchBlinds::setTargetPosition(int target, bool addSafetyMargin) {
-  if (target <= 0) {
-    target = addSafetyMargin ? -SAFETY_DELTA : 0;
-  }
-  if (target >= _maxPosition) {
-    target = _maxPosition + (addSafetyMargin ? SAFETY_DELTA : 0);
-  }
-
-  if (_targetPosition == target) {
+  if (_motorCount == 1) {
+    MotorState state = _motors[0].motorState();
+    _io.setLedLevels(0, state == Motor_Opening ? _levelChanging : 0,
+                     state == Motor_Closing ? _levelChanging : 0, _levelTouch,
+                     _levelRed);
     return;
   }
 
-  _targetPosition = target;
-
-  if (getCurrentPosition() < _targetPosition) {
-    changeMotor(Motor_Closing);
-  } else if (getCurrentPosition() > _targetPosition) {
-    changeMotor(Motor_Opening);
+  uint8_t levels[BLINDS_MOTORS] = {};
+  for (uint8_t i = 0; i < _motorCount; i++) {
+    MotorState state = _motors[i].motorState();
+    if (state == Motor_Opening || state == Motor_Closing) {
+      levels[i] = _levelChanging;
+    }
   }
+  _io.setLedLevels(levels[0], levels[1], levels[2], _levelTouch, _levelRed);
 }
 
 void SwitchBlinds::appendState(JsonVariant doc) const {
-  if (_initialized) {
-    int openPercent = (int)(100 - _targetPosition * 100 / _maxPosition);
-    if (openPercent < 0) {
-      openPercent = 0;
-    } else if (openPercent > 100) {
-      openPercent = 100;
-    }
+  if (!_initialized) {
+    return;
+  }
 
-    doc["openPercent"] = openPercent;
-    doc["target"] = _targetPosition;
-    doc["current"] = getCurrentPosition(true);
-    doc["motor"] = getMotorStatus();
+  // the first motor stays at the top level for single motor clients
+  _motors[0].appendState(doc);
+  if (_motorCount > 1) {
+    auto motors = doc["motors"].to<JsonArray>();
+    for (uint8_t i = 0; i < _motorCount; i++) {
+      _motors[i].appendState(motors.add<JsonObject>());
+    }
   }
 }
 
 void SwitchBlinds::updateState(JsonVariantConst state, bool isFromStoredState) {
-  if (!_initialized)
+  if (!_initialized) {
     return;
+  }
 
-  if (isFromStoredState) {
-    if (_motorState != Motor_Off)
-      return;
-
-    // restore state from JSON (most probably motor position hasn't changed)
-    _position = state["current"];
-    int targetPosition = state["target"];
-    setTargetPosition(targetPosition, false);
-  } else {
-    auto stateOpenPercent = state["openPercent"];
-    if (stateOpenPercent.is<int>()) {
-      int openPercent = stateOpenPercent;
-      setTargetPosition((100 - openPercent) * _maxPosition / 100, true);
+  auto motors = state["motors"];
+  for (uint8_t i = 0; i < _motorCount; i++) {
+    auto motorState = motors[i];
+    if (!motorState.isNull()) {
+      _motors[i].updateState(motorState, isFromStoredState);
+    } else if (i == 0 ||
+               (!isFromStoredState && state["calibrate"].isNull())) {
+      // top level fields move every motor, only the first one calibrates
+      _motors[i].updateState(state, isFromStoredState);
     }
   }
 }
 
-String SwitchBlinds::getMotorStatus() const {
-  switch (_motorState) {
-  case Motor_Off:
-    return "off";
-  case Motor_Opening:
-    return "open";
-  case Motor_Closing:
-    return "close";
-  default:
-    return "unknown";
-  }
-}
\ No newline at end of file
+void SwitchBlinds::onCalibrated(BlindsMotorCalibratedHandler handler) {
+  _calibrated = handler;
+}
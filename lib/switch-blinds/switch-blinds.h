@@ -1,45 +1,40 @@
 #ifndef _SWITCH_BLINDS_H_
 #define _SWITCH_BLINDS_H_
 
+#include "blinds-motor.h"
+#include "config-model.h"
 #include "io.h"
+#include "stagger.h"
 #include "switch-base.h"
 #include "util.h"
-#include <Ticker.h>
 
-enum MotorState {
-  Motor_Off = 0,
-  Motor_Opening,
-  Motor_Closing,
-};
+#define BLINDS_MOTORS CONFIG_CHANNELS
+
+typedef std::function<void(uint8_t motor, const uint32_t *openMs,
+                           const uint32_t *closeMs)>
+    BlindsMotorCalibratedHandler;
 
 class SwitchBlinds : public SwitchBase {
   Io &_io;
-  bool _initialized;
-  int8_t _pinOpen, _pinClose;
-  MotorState _motorState = Motor_Off;
+  bool _initialized = false;
+  BlindsMotor _motors[BLINDS_MOTORS];
+  uint8_t _motorCount = 1;
+  // shared by the motors so simultaneous starts are spread out
+  Stagger _stagger;
   uint8_t _levelTouch, _levelRed, _levelChanging;
-  int _position = 0;
-  int _targetPosition = 0;
-  int _maxPosition;
-  int _openCloseDelta;
-  uint32_t _motorChange;
-  uint16_t _delayAfterOff;
-  Ticker _ticker;
+  BlindsMotorCalibratedHandler _calibrated;
 
   void updateLevels();
-  void changeMotor(MotorState newState);
-  int getCurrentPosition(bool limit = false) const;
-  void setTargetPosition(int target, bool addSafetyMargin);
-  String getMotorStatus() const;
+  void touch(int8_t key);
 
 public:
   SwitchBlinds(Io &io);
 
-  bool configure(const JsonVariantConst config);
+  void configure(const BlindsConfig &config);
+  void end();
   void appendState(JsonVariant doc) const;
   void updateState(JsonVariantConst state, bool isFromStoredState) override;
-
-  void update();
+  void onCalibrated(BlindsMotorCalibratedHandler handler);
 };
 
-#endif
\ No newline at end of file
+#endif
@@ -1,64 +1,63 @@
 #include "switch-common.h"
+#include "boot-timeline.h"
 #include "esp32/rom/rtc.h"
+#include "latency.h"
+#include "metrics.h"
+#include "power.h"
 #include <ArduinoOTA.h>
 #include <ESPmDNS.h>
-#include <Ticker.h>
 #include <WiFi.h>
 
-SwitchCommon::SwitchCommon(Io &io) : _io(io) {}
+#define HEARTBEAT_TICKS 300
+
+SwitchCommon::SwitchCommon(Io &io, WifiConnect &wifi)
+    : _io(io), _wifi(wifi), _wifiBackoff(SECS(10), MINS(5), 0x57494649),
+      _mqttBackoff(SECS(2), MINS(2), 0x4d515454) {
+  // spread periodic state publishes of the whole fleet over the interval
+  _heartbeatPhase = _mqttBackoff.spread(HEARTBEAT_TICKS);
+  _sendStateSkips = _heartbeatPhase;
+}
 
 void SwitchCommon::appendStatus(JsonVariant doc) {
   _io.appendStatus(doc);
+  _wifi.appendStatus(doc);
+  _wifiBackoff.appendStatus(doc["wifi"]["backoff"].to<JsonObject>());
   auto mqttStatus = doc["mqtt"].to<JsonObject>();
   mqttStatus["connected"] = _mqtt.connected();
+  _mqttBackoff.appendStatus(mqttStatus["backoff"].to<JsonObject>());
+  _localGroup.appendStatus(doc["group"].to<JsonObject>());
+  _rules.appendStatus(doc["rules"].to<JsonObject>());
+  BootTimeline::appendTimeline(doc["boot"].to<JsonObject>());
+  CommandLatency::appendStatus(doc["latency"].to<JsonObject>());
 }
 
-bool SwitchCommon::configureIo(const JsonVariantConst config) {
-  auto pinsConfig = config["pins"];
-
-  auto pinsLedConfig = pinsConfig["led"];
-  int8_t led1 = pinsLedConfig[0] | -1;
-  int8_t led2 = pinsLedConfig[1] | -1;
-  int8_t led3 = pinsLedConfig[2] | -1;
-  int8_t ledRed = pinsConfig["redLed"] | -1;
-  bool invertRedLed = pinsConfig["redLedInvert"] | false;
-  bool pinsChanged = _io.useLedPins(led1, led2, led3, ledRed, invertRedLed);
-
-  auto pinsQtConfig = pinsConfig["qt"];
-  auto inputPinsConfig = pinsConfig["input"];
-  auto pinsTouchConfig = pinsConfig["touch"];
-
-  if (!pinsQtConfig.isNull()) {
-    int8_t qtSda = pinsQtConfig["sda"] | -1;
-    int8_t qtScl = pinsQtConfig["scl"] | -1;
-    int8_t qtCh1 = pinsQtConfig["ch"][0] | -1;
-    int8_t qtCh2 = pinsQtConfig["ch"][1] | -1;
-    int8_t qtCh3 = pinsQtConfig["ch"][2] | -1;
+void SwitchCommon::configureIo(const DeviceConfig &config) {
+  // io tears itself down when pins change and comes back up in begin
+  const IoConfig &io = config.io;
+  _io.useLedPins(io.led[0], io.led[1], io.led[2], io.redLed, io.redLedInvert);
 
-    pinsChanged |= _io.useQtTouch(qtSda, qtScl, qtCh1, qtCh2, qtCh3);
-  } else if (!inputPinsConfig.isNull()) {
-    int8_t input1 = inputPinsConfig[0] | -1;
-    int8_t input2 = inputPinsConfig[1] | -1;
-    int8_t input3 = inputPinsConfig[2] | -1;
-    pinsChanged |= _io.useInputPins(input1, input2, input3);
+  if (io.input == Input_Qt) {
+    _io.useQtTouch(io.qtSda, io.qtScl, io.qtChannels[0], io.qtChannels[1],
+                   io.qtChannels[2]);
+  } else if (io.input == Input_Pins) {
+    _io.useInputPins(io.inputPins[0], io.inputPins[1], io.inputPins[2]);
   }
 
-  bool isSwitch = config["type"] == "switch";
-  _io.begin(isSwitch ? 0 : MSEC(500), isSwitch ? false : true);
+  _io.setSnapshotInterval(io.statusInterval);
 
-  return pinsChanged;
+  bool isSwitch = config.type == Device_Switch;
+  _io.begin(isSwitch ? 0 : MSEC(500), isSwitch ? false : true);
 }
 
-void SwitchCommon::configureMqtt(const JsonVariantConst config,
-                                 const String host) {
-  auto mqttConfig = config["mqtt"];
-
-  _mqttHost = mqttConfig["host"] | "";
-  _mqttPassword = mqttConfig["password"] | "";
-  _mqttUser = mqttConfig["user"] | "";
-  _mqttPort = mqttConfig["port"] | 1883;
-  String mqttPrefix = mqttConfig["prefix"] | "ha-switch";
-  mqttPrefix += "/";
+void SwitchCommon::configureMqtt(const MqttConfig &config,
+                                 JsonVariantConst groups, const String host) {
+  // before any field changes, a new user or password needs a reconnect too
+  String session = _mqttUri + _mqttClientId + _mqttUser + _mqttPassword;
+  _mqttHost = config.host;
+  _mqttPassword = config.password;
+  _mqttUser = config.user;
+  _mqttPort = config.port;
+  String mqttPrefix = config.prefix + "/";
 
   if (_mqttHost.length() && _mqttPassword.length() && _mqttUser.length() &&
       _mqttPassword.length()) {
@@ -67,9 +66,13 @@ void SwitchCommon::configureMqtt(const JsonVariantConst config,
     _stateTopic = mqttPrefix + host + "/state";
     _stateSetTopic = _stateTopic + "/set";
     _debugTopic = mqttPrefix + host + "/debug";
+    _bootTopic = mqttPrefix + host + "/boot";
+    configureMqttGroups(groups, mqttPrefix);
 
     _mqttUri = "mqtt://" + _mqttHost + ":" + String(_mqttPort);
     _mqttClientId = host;
+    bool sessionChanged =
+        session != _mqttUri + _mqttClientId + _mqttUser + _mqttPassword;
 
     _mqtt.setServer(_mqttUri.c_str())
         .setClientId(_mqttClientId.c_str())
@@ -81,6 +84,22 @@ void SwitchCommon::configureMqtt(const JsonVariantConst config,
             return;
           }
 
+          // keeps the groups alive while configure swaps in new ones
+          auto groups = mqttGroups();
+          const MqttGroup *group = nullptr;
+          for (auto &mqttGroup : *groups) {
+            if (mqttGroup.topic == topic) {
+              group = &mqttGroup;
+              break;
+            }
+          }
+
+          auto isCommand = group || _stateSetTopic == topic;
+          if (isCommand) {
+            CommandLatency::received();
+            Power::interaction();
+          }
+
           JsonDocument stateUpdate;
           auto error = deserializeJson(stateUpdate, payload);
           if (error != DeserializationError::Code::Ok) {
@@ -91,36 +110,54 @@ void SwitchCommon::configureMqtt(const JsonVariantConst config,
               offset += snprintf(debugMsg + offset, sizeof(debugMsg) - offset, "%02x", payload[i]);
             }
 
-            _mqtt.publish(_debugTopic.c_str(), 0, false, debugMsg);
+            publish(_debugTopic.c_str(), 0, false, debugMsg);
             return;
           }
 
           auto isRecall = _stateTopic == topic;
-          if (_stateSetTopic == topic || isRecall) {
+          if (isCommand || isRecall) {
             if (isRecall) {
               unsubsribeFromState();
+            } else {
+              CommandLatency::parsed();
+            }
+
+            if (group) {
+              adjustGroupCommand(*group, stateUpdate);
             }
 
             if (stateUpdate["suspendInputs"].is<bool>()) {
               _io.setSuspendInputs(stateUpdate["suspendInputs"]);
             }
 
+            if (isCommand) {
+              CommandLatency::dispatched();
+            }
             _stateChanged(stateUpdate, isRecall);
             _lastReceivedMessage = millis();
+
+            if (isCommand) {
+              _rules.handleCommand(stateUpdate);
+            }
           }
         })
+        .onPublish([](int msgId) { CommandLatency::acked(msgId); })
         .onConnect([this, host, mqttPrefix](bool sessionPresent) {
           _connectedAt = millis();
+          BootTimeline::mark(Boot_MqttConnected);
+          if (!_firstConnection) {
+            Metrics::count(Metric_MqttReconnects);
+          }
 
           if (_updateFromStateOnBoot) {
             _mqtt.subscribe(_stateTopic.c_str(), 0);
           } else {
-            _mqtt.subscribe(_stateSetTopic.c_str(), 0);
+            subscribeToCommands();
             publishStateInternal();
           }
-          _mqtt.publish((mqttPrefix + host + "/version").c_str(), 0, false,
-                        BUILD_VERSION);
-          _mqtt.publish(_onlineTopic.c_str(), 0, true, "true");
+          publish((mqttPrefix + host + "/version").c_str(), 0, false,
+                  BUILD_VERSION);
+          publish(_onlineTopic.c_str(), 0, true, "true");
 
           if (_firstConnection) {
             _firstConnection = false;
@@ -128,24 +165,139 @@ void SwitchCommon::configureMqtt(const JsonVariantConst config,
             char resetReasonString[20];
             snprintf(resetReasonString, 5, "%d", resetReason);
             String resetReasonTopic = mqttPrefix + host + "/reset-reason";
-            _mqtt.publish(resetReasonTopic.c_str(), 0, false,
-                          resetReasonString);
+            publish(resetReasonTopic.c_str(), 0, false, resetReasonString);
           }
         });
 
+    if (sessionChanged && _mqtt.connected()) {
+      // the supervisor reconnects with the new server, id and will
+      _mqtt.disconnect();
+    }
+
+    _mqttEnabled = true;
     _timer.attach_ms(SECS(1), SwitchCommon::handle, this);
   } else {
+    _mqttEnabled = false;
     _mqtt.disconnect();
     _timer.detach();
   }
 }
 
+void SwitchCommon::configureMqttGroups(const JsonVariantConst config,
+                                       String prefix) {
+  auto groups = std::make_shared<std::vector<MqttGroup>>();
+  for (JsonVariantConst groupConfig : config.as<JsonArrayConst>()) {
+    // either just the name or {"name", "scale": {..}, "offset": {..}}
+    String name = groupConfig.is<const char *>() ? groupConfig.as<String>()
+                                                 : groupConfig["name"] | "";
+    if (!name.length() || name.indexOf('/') >= 0 || name.indexOf('+') >= 0 ||
+        name.indexOf('#') >= 0) {
+      continue;
+    }
+
+    MqttGroup group;
+    group.topic = prefix + "group/" + name + "/set";
+    if (groupConfig.is<JsonObjectConst>()) {
+      group.adjust["scale"] = groupConfig["scale"];
+      group.adjust["offset"] = groupConfig["offset"];
+    }
+    groups->push_back(group);
+  }
+
+  MqttGroups previous = groups;
+  portENTER_CRITICAL(&_mqttGroupsLock);
+  _mqttGroups.swap(previous);
+  portEXIT_CRITICAL(&_mqttGroupsLock);
+
+  // while still waiting for the stored state the commands are subscribed
+  // once it arrived
+  if (!_mqtt.connected() || _updateFromStateOnBoot) {
+    return;
+  }
+
+  if (previous) {
+    for (auto &old : *previous) {
+      bool kept = false;
+      for (auto &group : *groups) {
+        kept = kept || group.topic == old.topic;
+      }
+      if (!kept) {
+        _mqtt.unsubscribe(old.topic.c_str());
+      }
+    }
+  }
+  subscribeToCommands();
+}
+
+MqttGroups SwitchCommon::mqttGroups() {
+  portENTER_CRITICAL(&_mqttGroupsLock);
+  MqttGroups groups = _mqttGroups;
+  portEXIT_CRITICAL(&_mqttGroupsLock);
+  return groups ? groups : std::make_shared<std::vector<MqttGroup>>();
+}
+
+void SwitchCommon::adjustGroupCommand(const MqttGroup &group,
+                                      JsonVariant command) {
+  auto scale = group.adjust["scale"];
+  auto offset = group.adjust["offset"];
+  if (scale.isNull() && offset.isNull()) {
+    return;
+  }
+
+  for (JsonPair field : command.as<JsonObject>()) {
+    auto fieldScale = scale[field.key()];
+    auto fieldOffset = offset[field.key()];
+    if (!field.value().is<int>() ||
+        (fieldScale.isNull() && fieldOffset.isNull())) {
+      continue;
+    }
+
+    int value = roundf(field.value().as<int>() * (fieldScale | 1.0f) +
+                       (fieldOffset | 0.0f));
+    // brightness and openPercent are percentages, other fields pass through
+    if (field.key() == "brightness" || field.key() == "openPercent") {
+      value = constrain(value, 0, 100);
+    }
+    field.value().set(value);
+  }
+}
+
+void SwitchCommon::subscribeToCommands() {
+  _mqtt.subscribe(_stateSetTopic.c_str(), 0);
+  for (auto &group : *mqttGroups()) {
+    _mqtt.subscribe(group.topic.c_str(), 0);
+  }
+}
+
+void SwitchCommon::configureLocalGroup(const GroupConfig &config) {
+  _localGroup.configure(config);
+  _localGroup.onState([this](JsonVariant state) {
+    if (_stateChanged) {
+      _stateChanged(state, false);
+    }
+  });
+  _localGroup.onTouch([this](uint32_t sender, uint8_t key, uint8_t event) {
+    _rules.handleGroupKey(key, event);
+  });
+  _io.onKeyEvent([this](int8_t key, KeyEvent event) {
+    _localGroup.sendTouch(key, event);
+    _rules.handleKey(key, event);
+  });
+
+  if (WiFi.isConnected()) {
+    _localGroup.listen();
+  }
+}
+
 void SwitchCommon::handle(SwitchCommon *instance) {
+  MetricScope scope(Callback_Supervisor);
   SwitchCommon &me = *instance;
   auto now = millis();
   if (WiFi.isConnected()) {
-    me._reconnectWifiSkips = 0;
-    if (!me._mqtt.connected()) {
+    me._wifiBackoff.reset();
+    if (me._mqtt.connected()) {
+      me._mqttBackoff.reset();
+    } else if (me._mqttBackoff.shouldAttempt(now)) {
       me._mqtt.connect();
     }
 
@@ -155,9 +307,18 @@ void SwitchCommon::handle(SwitchCommon *instance) {
       me.publishStateInternal();
     }
 
-    if (++me._sendStateSkips == 300) {
+    if (++me._sendStateSkips >= HEARTBEAT_TICKS) {
       me._sendStateSkips = 0;
       me.publishStateInternal();
+
+      if (CommandLatency::hasSamples()) {
+        JsonDocument latency;
+        CommandLatency::appendStatus(latency);
+        String payload;
+        serializeJson(latency, payload);
+        me.publish((me._debugTopic + "/latency").c_str(), 0, false,
+                   payload.c_str());
+      }
     }
 
     if (me._lastReceivedMessage &&
@@ -166,67 +327,130 @@ void SwitchCommon::handle(SwitchCommon *instance) {
       me._lastReceivedMessage = 0;
       me.resetPendingCommand();
     }
-  } else {
-    me._sendStateSkips = 0;
-    if (++me._reconnectWifiSkips == 6) {
-      me._reconnectWifiSkips = 0;
 
-      WiFi.mode(WIFI_MODE_STA);
-      WiFi.disconnect();
-      WiFi.begin();
+    if (!me._bootTimelinePublished && BootTimeline::isComplete()) {
+      me._bootTimelinePublished = true;
+
+      JsonDocument timeline;
+      BootTimeline::appendTimeline(timeline);
+      String payload;
+      serializeJson(timeline, payload);
+      me.publish(me._bootTopic.c_str(), 0, false, payload.c_str());
+    }
+  } else {
+    me._sendStateSkips = me._heartbeatPhase;
+    if (me._wifiBackoff.shouldAttempt(now)) {
+      me._wifi.reconnect();
     }
   }
 }
 
 void SwitchCommon::publishState() {
-  publishStateInternal();
+  // only the answer to a command is acked, it gives the round trip time
+  int qos = CommandLatency::awaitsConfirm() ? 1 : 0;
+  CommandLatency::published(publishStateInternal(qos, true));
   resetPendingCommand();
 }
 
+int SwitchCommon::publish(const char *topic, int qos, bool retain,
+                          const char *payload) {
+  Metrics::count(Metric_MqttPublishes);
+  int msgId = _mqtt.publish(topic, qos, retain, payload);
+  if (msgId < 0) {
+    Metrics::count(Metric_MqttPublishDrops);
+  }
+  return msgId;
+}
+
 void SwitchCommon::resetPendingCommand() {
-  _mqtt.publish(_stateSetTopic.c_str(), 0, true);
+  publish(_stateSetTopic.c_str(), 0, true);
 }
 
-void SwitchCommon::publishStateInternal() {
+int SwitchCommon::publishStateInternal(int qos, bool broadcast) {
   _lastStateUpdateSent = millis();
+  if (_mqtt.connected()) {
+    BootTimeline::mark(Boot_StateSynced);
+  }
 
   JsonDocument stateJson;
   if (_getState) {
     _getState(stateJson);
   }
+  if (broadcast) {
+    _localGroup.sendState(stateJson);
+    _rules.handleState(stateJson);
+  }
+
   String state;
   serializeJson(stateJson, state);
-  _mqtt.publish(_stateTopic.c_str(), 0, true, state.c_str());
+  return publish(_stateTopic.c_str(), qos, true, state.c_str());
 }
 
-bool SwitchCommon::configure(const JsonVariantConst config) {
-  bool otaEnabled = config["ota"]["enabled"] | true;
-  String otaPassword = config["ota"]["password"] | "";
-  String host = config["mdns"]["host"] | "ha-switch";
+void SwitchCommon::configure(const DeviceConfig &config,
+                             JsonVariantConst json) {
+  const OtaConfig &ota = config.ota;
+  String host = config.mdns.host.length() ? config.mdns.host : "ha-switch";
 
-  bool mdnsEnabled = config["mdns"]["enabled"] | true;
-  if (mdnsEnabled) {
+  if (config.mdns.enabled) {
+    // restart the responder so a renamed host is announced right away
+    MDNS.end();
     MDNS.begin(host.c_str());
-    if (otaEnabled) {
-      uint16_t otaPort = config["ota"]["port"] | 3232;
-      MDNS.enableArduino(otaPort, otaPassword.length() > 0);
+    if (ota.enabled) {
+      MDNS.enableArduino(ota.port, ota.password.length() > 0);
     }
     MDNS.addService("http", "tcp", 80);
   } else {
     MDNS.end();
   }
 
-  if (otaEnabled) {
-    if (otaPassword.length()) {
-      ArduinoOTA.setPassword(otaPassword.c_str());
+  if (ota.enabled) {
+    if (ota.password.length()) {
+      ArduinoOTA.setPassword(ota.password.c_str());
     }
+    // full speed and no light sleep while an update is written, an auth
+    // error comes without a start and releases nothing
+    ArduinoOTA.onStart([] { Power::acquire(Power_Ota); })
+        .onEnd([] { Power::release(Power_Ota); })
+        .onError([](ota_error_t) { Power::release(Power_Ota); });
     ArduinoOTA.setMdnsEnabled(false).begin();
   } else {
     ArduinoOTA.end();
   }
 
-  configureMqtt(config, host);
-  return configureIo(config);
+  // don't wait for the next supervision tick once the network is up
+  _wifi.onGotIp([this] {
+    _localGroup.listen();
+    if (_mqttEnabled && !_mqtt.connected()) {
+      _mqtt.connect();
+    }
+  });
+
+  configureMqtt(config.mqtt, json["mqtt"]["groups"], host);
+  configureLocalGroup(config.group);
+  configureRules(config.time, json["rules"]);
+  configureIo(config);
+}
+
+void SwitchCommon::configureRules(const TimeConfig &config,
+                                  JsonVariantConst rules) {
+  _rules.onGetState([this](JsonVariant state) {
+    if (_getState) {
+      _getState(state);
+    }
+  });
+  _rules.onApply([this](JsonVariant state) {
+    if (_stateChanged) {
+      _stateChanged(state, false);
+    }
+  });
+  _rules.compile(rules);
+
+  // time of day conditions need the clock, SNTP keeps the server pointer
+  if (config.enabled) {
+    _timeServer = config.server;
+    _timeZone = config.tz;
+    configTzTime(_timeZone.c_str(), _timeServer.c_str());
+  }
 }
 
 void SwitchCommon::onGetState(GetJsonStateHandler getState) {
@@ -237,10 +461,13 @@ void SwitchCommon::onStateChanged(JsonStateChangedHandler handler) {
   _stateChanged = handler;
 }
 
+void SwitchCommon::skipStateRecall() { _updateFromStateOnBoot = false; }
+
 void SwitchCommon::unsubsribeFromState() {
   if (_updateFromStateOnBoot) {
     _updateFromStateOnBoot = false;
+    BootTimeline::mark(Boot_StateSynced);
     _mqtt.unsubscribe(_stateTopic.c_str());
-    _mqtt.subscribe(_stateSetTopic.c_str(), 0);
+    subscribeToCommands();
   }
 }
@@ -1,17 +1,32 @@
 #ifndef _SWITCHCOMMON_H_
 #define _SWITCHCOMMON_H_
 
+#include "backoff.h"
+#include "config-model.h"
 #include "io.h"
+#include "local-group.h"
+#include "rules.h"
+#include "timers.h"
+#include "wifi-connect.h"
 #include <ArduinoJson.h>
 #include <PsychicMqttClient.h>
-#include <Ticker.h>
+#include <memory>
+#include <vector>
 
 typedef std::function<void(JsonVariant state)> GetJsonStateHandler;
 typedef std::function<void(JsonVariant state, bool isFromStoredState)>
     JsonStateChangedHandler;
 
+struct MqttGroup {
+  String topic;
+  JsonDocument adjust;
+};
+
+typedef std::shared_ptr<const std::vector<MqttGroup>> MqttGroups;
+
 class SwitchCommon {
   Io &_io;
+  WifiConnect &_wifi;
   String _mqttHost;
   String _mqttUri;
   String _mqttPassword;
@@ -21,34 +36,55 @@ class SwitchCommon {
   String _stateTopic;
   String _stateSetTopic;
   String _debugTopic;
+  String _bootTopic;
+  MqttGroups _mqttGroups;
+  portMUX_TYPE _mqttGroupsLock = portMUX_INITIALIZER_UNLOCKED;
   String _mqttClientId;
   GetJsonStateHandler _getState;
   JsonStateChangedHandler _stateChanged;
   bool _updateFromStateOnBoot = true;
   PsychicMqttClient _mqtt;
-  Ticker _timer;
-  int _reconnectWifiSkips = 0;
+  bool _mqttEnabled = false;
+  LocalGroup _localGroup;
+  Rules _rules;
+  String _timeServer;
+  String _timeZone;
+  Timer _timer{"supervisor"};
+  Backoff _wifiBackoff;
+  Backoff _mqttBackoff;
   int _sendStateSkips = 0;
+  int _heartbeatPhase = 0;
   bool _firstConnection = true;
+  bool _bootTimelinePublished = false;
   uint32_t _connectedAt = 0;
   uint32_t _lastReceivedMessage = 0;
   uint32_t _lastStateUpdateSent = 0;
 
-  bool configureIo(const JsonVariantConst config);
-  void configureMqtt(const JsonVariantConst config, String host);
+  void configureIo(const DeviceConfig &config);
+  void configureMqtt(const MqttConfig &config, JsonVariantConst groups,
+                     String host);
+  void configureLocalGroup(const GroupConfig &config);
+  void configureRules(const TimeConfig &config, JsonVariantConst rules);
+  void configureMqttGroups(const JsonVariantConst config, String prefix);
+  MqttGroups mqttGroups();
+  void subscribeToCommands();
   void unsubsribeFromState();
+  static void adjustGroupCommand(const MqttGroup &group, JsonVariant command);
 
   static void handle(SwitchCommon *instance);
-  void publishStateInternal();
+  int publishStateInternal(int qos = 0, bool broadcast = false);
+  int publish(const char *topic, int qos, bool retain,
+              const char *payload = nullptr);
   void resetPendingCommand();
 
 public:
-  SwitchCommon(Io &io);
+  SwitchCommon(Io &io, WifiConnect &wifi);
 
   void onGetState(GetJsonStateHandler getState);
-  bool configure(const JsonVariantConst config);
+  void configure(const DeviceConfig &config, JsonVariantConst json);
   void appendStatus(JsonVariant doc);
   void publishState();
+  void skipStateRecall();
   void onStateChanged(JsonStateChangedHandler stateChanged);
 };
 
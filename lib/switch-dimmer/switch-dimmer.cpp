@@ -5,11 +5,13 @@
 
 SwitchDimmer::SwitchDimmer(Io &io) : _io(io) {}
 
-bool SwitchDimmer::configure(const JsonVariantConst config) {
-  int8_t zero = config["pins"]["zero"] | -1;
-  int8_t triac = config["pins"]["triac"] | -1;
+bool SwitchDimmer::configure(const DimmerConfig &config) {
+  if (_initialized && !_dimmer.hasPins(config.zero, config.triac) && !end()) {
+    // the old program still drives the triac, only a reboot frees it
+    return true;
+  }
 
-  bool needsReboot = _dimmer.usePins(zero, triac);
+  _dimmer.usePins(config.zero, config.triac);
   if (!_initialized) {
     _dimmer.begin();
 
@@ -49,28 +51,33 @@ bool SwitchDimmer::configure(const JsonVariantConst config) {
     });
   }
 
-  auto curveConfig = config["curve"].as<JsonArrayConst>();
-  if (curveConfig.size() == 100) {
-    uint16_t curve[100];
-    for (uint8_t i = 0; i < 100; i++) {
-      curve[i] = curveConfig[i];
-    }
-    _dimmer.setBrightnessCurve(curve);
+  if (config.hasCurve) {
+    _dimmer.setBrightnessCurve(config.curve);
   }
 
-  auto onLevels = config["levels"]["on"];
-  auto offLevels = config["levels"]["off"];
-
-  _onBlueLevel = onLevels["blue"] | 20;
-  _onBlueTouchLevel = onLevels["touch"] | 255;
-  _onRedLevel = onLevels["red"] | 0;
-  _offBlueLevel = offLevels["blue"] | 0;
-  _offBlueTouchLevel = offLevels["touch"] | 255;
-  _offRedLevel = offLevels["red"] | 20;
+  _onBlueLevel = config.on.blue;
+  _onBlueTouchLevel = config.on.touch;
+  _onRedLevel = config.on.red;
+  _offBlueLevel = config.off.blue;
+  _offBlueTouchLevel = config.off.touch;
+  _offRedLevel = config.off.red;
   updateLevels();
 
   _initialized = true;
-  return needsReboot;
+  return false;
+}
+
+bool SwitchDimmer::end() {
+  if (!_initialized) {
+    return true;
+  }
+  if (!_dimmer.end()) {
+    return false;
+  }
+
+  _io.onTouchDown(nullptr);
+  _initialized = false;
+  return true;
 }
 
 void SwitchDimmer::updateLevels() {
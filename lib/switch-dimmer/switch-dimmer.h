@@ -1,6 +1,7 @@
 #ifndef _SWITCH_DIMMER_
 #define _SWITCH_DIMMER_
 
+#include "config-model.h"
 #include "dimmer.h"
 #include "io.h"
 #include "switch-base.h"
@@ -20,7 +21,10 @@ class SwitchDimmer : public SwitchBase {
 
 public:
   SwitchDimmer(Io &io);
-  bool configure(const JsonVariantConst config);
+  // true when the old triac pin could not be released and a reboot is needed
+  bool configure(const DimmerConfig &config);
+  // false when the ULP program did not stop
+  bool end();
   void appendState(JsonVariant doc) const;
   void updateState(JsonVariantConst state, bool isFromStoredState) override;
 };
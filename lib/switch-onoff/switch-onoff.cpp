@@ -1,30 +1,55 @@
 #include "switch-onoff.h"
+#include "latency.h"
+#include "metrics.h"
+
+// esp_timer task latency, a crossing closer than this is skipped
+#define ZERO_CROSS_LEAD 500
+// relays due within this are switched together
+#define RELAY_TIMER_SLACK 50
 
 SwitchOnOff::SwitchOnOff(Io &io) : _io(io), _pins{-1, -1, -1} {}
 
-bool SwitchOnOff::configure(const JsonVariantConst config) {
-  bool needsReboot = false;
+void SwitchOnOff::configure(const SwitchConfig &config) {
+  bool pinsChanged = false;
+  for (uint8_t i = 0; i < IO_CNT; i++) {
+    pinsChanged |= _pins[i] != config.pins[i];
+  }
+  if (pinsChanged) {
+    end();
+  }
 
   for (uint8_t i = 0; i < IO_CNT; i++) {
-    int8_t newPin = config["pins"][i] | -1;
-    needsReboot |= _pins[i] != newPin;
-    _pins[i] = newPin;
+    _pins[i] = config.pins[i];
+    _operate[i] = config.operate[i];
   }
+  _zeroCross.begin(config.zero);
+  _stagger.setGap(config.startGap);
 
   if (!_initialized) {
+    if (!_relayTimer) {
+      esp_timer_create_args_t args = {};
+      args.callback = SwitchOnOff::handleRelayTimer;
+      args.arg = this;
+      args.name = "relays";
+      esp_timer_create(&args, &_relayTimer);
+    }
+
     for (uint8_t i = 0; i < IO_CNT; i++) {
       if (_pins[i] != -1) {
         pinMode(_pins[i], OUTPUT);
+        digitalWrite(_pins[i], _state[i] ? HIGH : LOW);
       }
     }
 
     _io.onTouchDown([this](int8_t key) {
+      suspendStateChanges();
       _state[key] = !_state[key];
       if (_pins[key] != -1) {
-        digitalWrite(_pins[key], _state[key] ? HIGH : LOW);
+        writePin(key);
       }
       updateLevels();
       raiseStateChanged();
+      endBatch();
 
       if (_resetAfter) {
         _resetPinsMask |= 1 << key;
@@ -33,18 +58,39 @@ bool SwitchOnOff::configure(const JsonVariantConst config) {
     });
   }
 
-  auto onLevels = config["levels"]["on"];
-  auto offLevels = config["levels"]["off"];
-  _blueTouchLevel = config["levels"]["touch"] | 255;
-  _onBlueLevel = onLevels["blue"] | 20;
-  _onRedLevel = onLevels["red"] | 0;
-  _offBlueLevel = offLevels["blue"] | 0;
-  _offRedLevel = offLevels["red"] | 20;
-  _resetAfter = config["resetAfter"] | 0;
+  _blueTouchLevel = config.touchLevel;
+  _onBlueLevel = config.on.blue;
+  _onRedLevel = config.on.red;
+  _offBlueLevel = config.off.blue;
+  _offRedLevel = config.off.red;
+  _resetAfter = config.resetAfter;
   updateLevels();
 
   _initialized = true;
-  return needsReboot;
+}
+
+void SwitchOnOff::end() {
+  if (!_initialized) {
+    return;
+  }
+
+  _ticker.detach();
+  _resetPinsMask = 0;
+  esp_timer_stop(_relayTimer);
+  _pendingMask = 0;
+  if (_holdingState.exchange(false)) {
+    resumeStateChanges();
+  }
+  _zeroCross.end();
+  for (uint8_t i = 0; i < IO_CNT; i++) {
+    if (_pins[i] != -1) {
+      digitalWrite(_pins[i], LOW);
+      pinMode(_pins[i], INPUT);
+    }
+  }
+
+  _io.onTouchDown(nullptr);
+  _initialized = false;
 }
 
 void SwitchOnOff::updateLevels() {
@@ -82,17 +128,98 @@ void SwitchOnOff::resetPins(SwitchOnOff *instance) {
     me.updateLevels();
   }
 
-  me.resumeStateChanges();
+  me.endBatch();
 }
 
 void SwitchOnOff::updatePin(uint8_t index, bool newState) {
   if (_pins[index] != -1 && newState != _state[index]) {
     _state[index] = newState;
-    digitalWrite(_pins[index], _state[index] ? HIGH : LOW);
+    writePin(index);
     raiseStateChanged();
   }
 }
 
+void SwitchOnOff::writePin(uint8_t index) {
+  // only turning on draws inrush, offs go out without a gap
+  uint32_t wait = _state[index] ? _stagger.reserve() * 1000 : 0;
+  uint32_t now = esp_timer_get_time();
+
+  int32_t until =
+      _zeroCross.untilCrossing(wait + _operate[index] + ZERO_CROSS_LEAD);
+  if (until >= 0) {
+    // the contacts close on the crossing, the coil is energized before it
+    _fireAt[index] = now + until - _operate[index];
+    Metrics::count(Metric_RelaysSynced);
+  } else if (wait) {
+    _fireAt[index] = now + wait;
+    Metrics::count(Metric_RelaysDelayed);
+  } else {
+    // no mains timing and no gap, switch right away
+    _pendingMask &= ~(1 << index);
+    digitalWrite(_pins[index], _state[index] ? HIGH : LOW);
+    Metrics::count(Metric_RelaysImmediate);
+    CommandLatency::applied();
+    return;
+  }
+
+  _pendingMask |= 1 << index;
+  armRelayTimer();
+}
+
+void SwitchOnOff::endBatch() {
+  // whoever clears the hold resumes it, the timer when relays are queued
+  if (!_holdingState.exchange(true)) {
+    if (_pendingMask) {
+      return;
+    }
+    if (!_holdingState.exchange(false)) {
+      return;
+    }
+  }
+  resumeStateChanges();
+}
+
+void SwitchOnOff::armRelayTimer() {
+  uint8_t pending = _pendingMask;
+  if (!pending) {
+    return;
+  }
+
+  uint32_t now = esp_timer_get_time();
+  int32_t next = INT32_MAX;
+  for (uint8_t i = 0; i < IO_CNT; i++) {
+    if (pending & (1 << i)) {
+      next = min(next, (int32_t)(_fireAt[i] - now));
+    }
+  }
+
+  esp_timer_stop(_relayTimer);
+  esp_timer_start_once(_relayTimer, max<int32_t>(next, 0));
+}
+
+void SwitchOnOff::handleRelayTimer(void *instance) {
+  MetricScope scope(Callback_Relays);
+  SwitchOnOff &me = *(SwitchOnOff *)instance;
+
+  uint32_t now = esp_timer_get_time();
+  uint8_t pending = me._pendingMask;
+  for (uint8_t i = 0; i < IO_CNT; i++) {
+    if ((pending & (1 << i)) &&
+        (int32_t)(me._fireAt[i] - now) <= RELAY_TIMER_SLACK) {
+      me._pendingMask &= ~(1 << i);
+      digitalWrite(me._pins[i], me._state[i] ? HIGH : LOW);
+      CommandLatency::applied();
+    }
+  }
+
+  if (!me._pendingMask && me._holdingState.exchange(false)) {
+    // the whole batch is out, published once
+    me.resumeStateChanges();
+    return;
+  }
+  me.armRelayTimer();
+}
+
 void SwitchOnOff::updateState(JsonVariantConst state, bool isFromStoredState) {
   if (!_initialized) {
     return;
@@ -148,5 +275,5 @@ void SwitchOnOff::updateState(JsonVariantConst state, bool isFromStoredState) {
     updateLevels();
   }
 
-  resumeStateChanges();
+  endBatch();
 }
\ No newline at end of file
@@ -1,9 +1,14 @@
 #ifndef _SWITCH_ONOFF_
 #define _SWITCH_ONOFF_
 
+#include "config-model.h"
 #include "io.h"
+#include "stagger.h"
 #include "switch-base.h"
+#include "zero-cross.h"
 #include <ArduinoJson.h>
+#include <atomic>
+#include <esp_timer.h>
 
 class SwitchOnOff : public SwitchBase {
   Io &_io;
@@ -13,16 +18,31 @@ class SwitchOnOff : public SwitchBase {
   uint8_t _onBlueLevel, _onRedLevel, _offBlueLevel, _offRedLevel,
       _blueTouchLevel;
   uint16_t _resetAfter;
-  Ticker _ticker;
+  Timer _ticker{"switch-reset"};
+  ZeroCross _zeroCross;
+  uint16_t _operate[IO_CNT] = {0, 0, 0};
+  // relays waiting for their zero crossing, switched from the timer
+  std::atomic<uint8_t> _pendingMask{0};
+  uint32_t _fireAt[IO_CNT];
+  esp_timer_handle_t _relayTimer = nullptr;
+  Stagger _stagger;
+  // state changes stay suspended until the queued relays have switched
+  std::atomic<bool> _holdingState{false};
   void updateLevels();
   void updatePin(uint8_t index, bool newState);
+  void writePin(uint8_t index);
+  void armRelayTimer();
+  void endBatch();
+
+  static void handleRelayTimer(void *instance);
 
   static void resetPins(SwitchOnOff *instance);
-  uint8_t _resetPinsMask;
+  uint8_t _resetPinsMask = 0;
 
 public:
   SwitchOnOff(Io &io);
-  bool configure(const JsonVariantConst config);
+  void configure(const SwitchConfig &config);
+  void end();
   void appendState(JsonVariant doc) const;
   void updateState(JsonVariantConst state, bool isFromStoredState) override;
 };
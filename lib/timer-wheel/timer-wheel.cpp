@@ -0,0 +1,168 @@
+#include "timer-wheel.h"
+
+#define SLOT_MASK (WHEEL_SLOTS - 1)
+#define SHIFT(level) (WHEEL_BITS * (level))
+
+static inline uint64_t rotateRight(uint64_t bits, uint8_t count) {
+  return count ? (bits >> count) | (bits << (64 - count)) : bits;
+}
+
+void TimerWheel::add(TimerNode *node, uint32_t now) {
+  if (linked(node)) {
+    remove(node);
+  }
+  if (!_count) {
+    // nothing pending, the wheel can jump ahead
+    _time = now;
+  }
+  _count++;
+  link(node);
+}
+
+void TimerWheel::link(TimerNode *node) {
+  int32_t delta = node->due - _time;
+  uint32_t at = node->due;
+  uint8_t level = 0;
+  if (delta <= 0) {
+    // already due, handed out from the current slot
+    at = _time;
+  } else {
+    while (level < WHEEL_LEVELS - 1 &&
+           (uint32_t)delta >= (1u << SHIFT(level + 1))) {
+      level++;
+    }
+  }
+
+  // beyond the top level the slot wraps, the node is linked again when
+  // the slot comes around
+  uint8_t slot = (at >> SHIFT(level)) & SLOT_MASK;
+  TimerNode *&head = _slots[level][slot];
+  node->level = level;
+  node->slot = slot;
+  node->next = head;
+  node->pprev = &head;
+  if (head) {
+    head->pprev = &node->next;
+  }
+  head = node;
+  _occupied[level] |= 1ull << slot;
+}
+
+void TimerWheel::remove(TimerNode *node) {
+  if (!linked(node)) {
+    return;
+  }
+
+  *node->pprev = node->next;
+  if (node->next) {
+    node->next->pprev = node->pprev;
+  }
+  if (!_slots[node->level][node->slot]) {
+    _occupied[node->level] &= ~(1ull << node->slot);
+  }
+  node->next = nullptr;
+  node->pprev = nullptr;
+  _count--;
+}
+
+bool TimerWheel::firstSlot(uint8_t level, uint8_t &slot,
+                           uint8_t &distance) const {
+  uint64_t bits = _occupied[level];
+  if (!bits) {
+    return false;
+  }
+
+  // first occupied slot after the current one, the current one comes last
+  uint8_t current = (_time >> SHIFT(level)) & SLOT_MASK;
+  uint8_t start = (current + 1) & SLOT_MASK;
+  distance = __builtin_ctzll(rotateRight(bits, start)) + 1;
+  slot = (current + distance) & SLOT_MASK;
+  return true;
+}
+
+bool TimerWheel::nextStep(uint32_t &time) const {
+  bool found = false;
+  for (uint8_t level = 0; level < WHEEL_LEVELS; level++) {
+    uint8_t slot, distance;
+    if (!firstSlot(level, slot, distance)) {
+      continue;
+    }
+
+    // level 0 slots are due times, higher ones are cascaded at their start
+    uint32_t candidate = level ? ((_time >> SHIFT(level)) + distance)
+                                     << SHIFT(level)
+                               : _time + distance;
+    if (!found || (int32_t)(candidate - _time) < (int32_t)(time - _time)) {
+      time = candidate;
+      found = true;
+    }
+  }
+  return found;
+}
+
+void TimerWheel::step(uint32_t time) {
+  _time = time;
+  for (uint8_t level = WHEEL_LEVELS - 1; level > 0; level--) {
+    if (time & ((1u << SHIFT(level)) - 1)) {
+      continue;
+    }
+
+    uint8_t slot = (time >> SHIFT(level)) & SLOT_MASK;
+    TimerNode *node = _slots[level][slot];
+    _slots[level][slot] = nullptr;
+    _occupied[level] &= ~(1ull << slot);
+    while (node) {
+      TimerNode *next = node->next;
+      link(node);
+      node = next;
+    }
+  }
+}
+
+TimerNode *TimerWheel::popDue(uint32_t now) {
+  while (true) {
+    TimerNode *node = _slots[0][_time & SLOT_MASK];
+    if (node) {
+      remove(node);
+      return node;
+    }
+
+    uint32_t next;
+    if (!_count) {
+      _time = now;
+      return nullptr;
+    }
+    if (!nextStep(next) || (int32_t)(next - now) > 0) {
+      return nullptr;
+    }
+    step(next);
+  }
+}
+
+uint32_t TimerWheel::untilNext(uint32_t now) const {
+  if (!_count) {
+    return UINT32_MAX;
+  }
+  if (_slots[0][_time & SLOT_MASK]) {
+    return 0;
+  }
+
+  // wake up for the earliest due time, cascading happens on the way
+  uint32_t due = 0;
+  bool found = false;
+  for (uint8_t level = 0; level < WHEEL_LEVELS; level++) {
+    uint8_t slot, distance;
+    if (!firstSlot(level, slot, distance)) {
+      continue;
+    }
+    for (TimerNode *node = _slots[level][slot]; node; node = node->next) {
+      if (!found || (int32_t)(node->due - due) < 0) {
+        due = node->due;
+        found = true;
+      }
+    }
+  }
+
+  int32_t until = due - now;
+  return until > 0 ? until : 0;
+}
@@ -0,0 +1,46 @@
+#ifndef _TIMER_WHEEL_H_
+#define _TIMER_WHEEL_H_
+
+#include <stdint.h>
+
+#define WHEEL_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+// 1 ms slots at the bottom, the top level spans about 12 days
+#define WHEEL_LEVELS 5
+
+// embedded in its owner so the wheel never allocates
+struct TimerNode {
+  TimerNode *next = nullptr;
+  // the pointer pointing at this node, unlinks without a search
+  TimerNode **pprev = nullptr;
+  uint32_t due = 0;
+  uint8_t level = 0, slot = 0;
+};
+
+// hierarchical timing wheel, O(1) add and remove. The ms clock is passed in
+// so it runs on the host against a fake clock as well.
+class TimerWheel {
+  TimerNode *_slots[WHEEL_LEVELS][WHEEL_SLOTS] = {};
+  uint64_t _occupied[WHEEL_LEVELS] = {};
+  // everything due up to here has been handed out
+  uint32_t _time = 0;
+  uint32_t _count = 0;
+
+  void link(TimerNode *node);
+  bool firstSlot(uint8_t level, uint8_t &slot, uint8_t &distance) const;
+  bool nextStep(uint32_t &time) const;
+  void step(uint32_t time);
+
+public:
+  // node->due must be set
+  void add(TimerNode *node, uint32_t now);
+  void remove(TimerNode *node);
+  static bool linked(const TimerNode *node) { return node->pprev; }
+
+  // one node due at now, or nullptr once there is none
+  TimerNode *popDue(uint32_t now);
+  // ms until the next node is due, UINT32_MAX when the wheel is empty
+  uint32_t untilNext(uint32_t now) const;
+};
+
+#endif
@@ -0,0 +1,204 @@
+#include "timers.h"
+#include "metrics.h"
+
+#define PREFIX "ha_switch_"
+
+TimerWheel Timers::_wheel;
+portMUX_TYPE Timers::_lock = portMUX_INITIALIZER_UNLOCKED;
+esp_timer_handle_t Timers::_timer = nullptr;
+SemaphoreHandle_t Timers::_armLock = nullptr;
+Timer *Timers::_running = nullptr;
+TaskHandle_t Timers::_task = nullptr;
+Timer *Timers::_timers = nullptr;
+
+Timer::Timer(const char *name) : _name(name) {
+  portENTER_CRITICAL(&Timers::_lock);
+  _nextTimer = Timers::_timers;
+  Timers::_timers = this;
+  portEXIT_CRITICAL(&Timers::_lock);
+}
+
+Timer::~Timer() {
+  detach();
+
+  portENTER_CRITICAL(&Timers::_lock);
+  for (Timer **timer = &Timers::_timers; *timer;
+       timer = &(*timer)->_nextTimer) {
+    if (*timer == this) {
+      *timer = _nextTimer;
+      break;
+    }
+  }
+  portEXIT_CRITICAL(&Timers::_lock);
+}
+
+void Timer::callPlain(void *callback) { ((void (*)())callback)(); }
+
+void Timer::start(uint32_t ms, uint32_t period, TimerCallback callback,
+                  void *arg) {
+  portENTER_CRITICAL(&Timers::_lock);
+  uint32_t now = Timers::now();
+  _period = period;
+  _callback = callback;
+  _arg = arg;
+  due = now + ms;
+  Timers::_wheel.add(this, now);
+  portEXIT_CRITICAL(&Timers::_lock);
+  Timers::arm();
+}
+
+void Timer::detach() {
+  portENTER_CRITICAL(&Timers::_lock);
+  Timers::_wheel.remove(this);
+  _period = 0;
+  portEXIT_CRITICAL(&Timers::_lock);
+}
+
+void Timer::detachAndWait() {
+  detach();
+
+  // callbacks run one after the other, from one of them nothing else runs
+  if (xTaskGetCurrentTaskHandle() == Timers::_task) {
+    return;
+  }
+  while (true) {
+    portENTER_CRITICAL(&Timers::_lock);
+    bool running = Timers::_running == this;
+    portEXIT_CRITICAL(&Timers::_lock);
+    if (!running) {
+      return;
+    }
+    vTaskDelay(1);
+  }
+}
+
+bool Timer::active() const { return TimerWheel::linked(this); }
+
+uint32_t Timers::now() { return esp_timer_get_time() / 1000; }
+
+void Timers::begin() {
+  if (_timer) {
+    return;
+  }
+  _armLock = xSemaphoreCreateMutex();
+  esp_timer_create_args_t args = {};
+  args.callback = Timers::handle;
+  args.name = "timers";
+  esp_timer_create(&args, &_timer);
+  arm();
+}
+
+void Timers::arm() {
+  if (!_timer) {
+    return;
+  }
+
+  // the wheel is read under the spinlock, esp_timer is programmed outside
+  // of it with interrupts enabled
+  xSemaphoreTake(_armLock, portMAX_DELAY);
+  portENTER_CRITICAL(&_lock);
+  int64_t nowUs = esp_timer_get_time();
+  uint32_t until = _wheel.untilNext(nowUs / 1000);
+  portEXIT_CRITICAL(&_lock);
+
+  esp_timer_stop(_timer);
+  if (until != UINT32_MAX) {
+    // due times are whole ms, wake right at the start of that ms
+    int64_t wait = (int64_t)until * 1000 - nowUs % 1000;
+    esp_timer_start_once(_timer, max<int64_t>(wait, 0));
+  }
+  xSemaphoreGive(_armLock);
+}
+
+void Timers::handle(void *arg) {
+  Metrics::count(Metric_TimerWakeups);
+
+  while (true) {
+    portENTER_CRITICAL(&_lock);
+    int64_t nowUs = esp_timer_get_time();
+    uint32_t now = nowUs / 1000;
+    Timer *timer = static_cast<Timer *>(_wheel.popDue(now));
+    TimerCallback callback = nullptr;
+    void *callbackArg = nullptr;
+    uint32_t late = 0;
+    _running = timer;
+    if (timer) {
+      _task = xTaskGetCurrentTaskHandle();
+      late = (now - timer->due) * 1000 + nowUs % 1000;
+      callback = timer->_callback;
+      callbackArg = timer->_arg;
+      if (timer->_period) {
+        // keeps the cadence, runs missed while busy are dropped
+        timer->due += timer->_period;
+        if ((int32_t)(timer->due - now) <= 0) {
+          timer->due = now + timer->_period;
+        }
+        _wheel.add(timer, now);
+      }
+    }
+    portEXIT_CRITICAL(&_lock);
+
+    if (!timer) {
+      break;
+    }
+    timer->_lateness.record(late);
+    callback(callbackArg);
+
+    portENTER_CRITICAL(&_lock);
+    _running = nullptr;
+    portEXIT_CRITICAL(&_lock);
+  }
+
+  arm();
+}
+
+void Timers::write(Print &out) {
+  out.print("# TYPE " PREFIX "timer_lateness_seconds histogram\n");
+  for (Timer *timer = _timers; timer; timer = timer->_nextTimer) {
+    // timers sharing a name, like one per motor, are reported together
+    bool first = true;
+    for (Timer *other = _timers; other != timer; other = other->_nextTimer) {
+      if (!strcmp(other->_name, timer->_name)) {
+        first = false;
+        break;
+      }
+    }
+    if (!first) {
+      continue;
+    }
+
+    uint32_t buckets[HISTOGRAM_BUCKETS] = {};
+    uint32_t count = 0;
+    uint64_t sum = 0;
+    for (Timer *same = timer; same; same = same->_nextTimer) {
+      if (!strcmp(same->_name, timer->_name)) {
+        for (uint8_t b = 0; b < HISTOGRAM_BUCKETS; b++) {
+          buckets[b] += same->_lateness.bucket(b);
+          count += same->_lateness.bucket(b);
+        }
+        sum += same->_lateness.sum();
+      }
+    }
+    if (!count) {
+      continue;
+    }
+
+    uint32_t cumulative = 0;
+    for (uint8_t b = 0; b < HISTOGRAM_BUCKETS; b++) {
+      cumulative += buckets[b];
+      if (b < HISTOGRAM_BUCKETS - 1) {
+        out.printf(PREFIX "timer_lateness_seconds_bucket{timer=\"%s\","
+                          "le=\"%g\"} %u\n",
+                   timer->_name, Histogram::bounds[b] / 1e6,
+                   (unsigned int)cumulative);
+      }
+    }
+    out.printf(PREFIX "timer_lateness_seconds_bucket{timer=\"%s\","
+                      "le=\"+Inf\"} %u\n",
+               timer->_name, (unsigned int)cumulative);
+    out.printf(PREFIX "timer_lateness_seconds_sum{timer=\"%s\"} %g\n",
+               timer->_name, sum / 1e6);
+    out.printf(PREFIX "timer_lateness_seconds_count{timer=\"%s\"} %u\n",
+               timer->_name, (unsigned int)cumulative);
+  }
+}
@@ -0,0 +1,85 @@
+#ifndef _TIMERS_H_
+#define _TIMERS_H_
+
+#include "histogram.h"
+#include "timer-wheel.h"
+#include <Arduino.h>
+#include <esp_timer.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+
+typedef void (*TimerCallback)(void *arg);
+
+// drop-in for Ticker, all timers share one wheel driven by a single one-shot
+// esp_timer, nothing wakes up while nothing is due
+class Timer : TimerNode {
+  friend class Timers;
+
+  const char *_name;
+  uint32_t _period = 0;
+  TimerCallback _callback = nullptr;
+  void *_arg = nullptr;
+  // how late the callback ran, in usec
+  Histogram _lateness;
+  Timer *_nextTimer = nullptr;
+
+  void start(uint32_t ms, uint32_t period, TimerCallback callback, void *arg);
+  static void callPlain(void *callback);
+
+public:
+  Timer(const char *name);
+  ~Timer();
+
+  // a period of 0 runs once
+  void attach_ms(uint32_t ms, void (*callback)()) {
+    start(ms, ms, Timer::callPlain, (void *)callback);
+  }
+
+  template <typename TArg>
+  void attach_ms(uint32_t ms, void (*callback)(TArg), TArg arg) {
+    static_assert(sizeof(TArg) <= sizeof(void *), "arg must fit a pointer");
+    start(ms, ms, reinterpret_cast<TimerCallback>(callback), (void *)arg);
+  }
+
+  void once_ms(uint32_t ms, void (*callback)()) {
+    start(ms, 0, Timer::callPlain, (void *)callback);
+  }
+
+  template <typename TArg>
+  void once_ms(uint32_t ms, void (*callback)(TArg), TArg arg) {
+    static_assert(sizeof(TArg) <= sizeof(void *), "arg must fit a pointer");
+    start(ms, 0, reinterpret_cast<TimerCallback>(callback), (void *)arg);
+  }
+
+  void detach();
+  // detach and wait for a callback that is already running, before the
+  // owner tears down what the callback uses
+  void detachAndWait();
+  bool active() const;
+};
+
+class Timers {
+  friend class Timer;
+
+  static TimerWheel _wheel;
+  static portMUX_TYPE _lock;
+  static esp_timer_handle_t _timer;
+  // keeps the programmed esp_timer in step with the latest wheel state
+  static SemaphoreHandle_t _armLock;
+  // the timer whose callback runs right now and the task running it
+  static Timer *_running;
+  static TaskHandle_t _task;
+  // every constructed timer, for the statistics
+  static Timer *_timers;
+
+  static uint32_t now();
+  static void arm();
+  static void handle(void *arg);
+
+public:
+  // creates the esp_timer, timers started before only run once it is done
+  static void begin();
+  static void write(Print &out);
+};
+
+#endif
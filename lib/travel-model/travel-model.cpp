@@ -0,0 +1,107 @@
+#include "travel-model.h"
+#include <algorithm>
+
+TravelModel::TravelModel() { setLinear(1, 1, 1); }
+
+void TravelModel::setLinear(int32_t range, uint32_t openMs, uint32_t closeMs) {
+  uint32_t openSegments[TRAVEL_SEGMENTS], closeSegments[TRAVEL_SEGMENTS];
+  for (uint8_t i = 0; i < TRAVEL_SEGMENTS; i++) {
+    openSegments[i] = openMs / TRAVEL_SEGMENTS;
+    closeSegments[i] = closeMs / TRAVEL_SEGMENTS;
+  }
+  setSegments(range, openSegments, closeSegments);
+}
+
+void TravelModel::setSegments(int32_t range, const uint32_t *openMs,
+                              const uint32_t *closeMs) {
+  _range = std::max<int32_t>(range, TRAVEL_SEGMENTS);
+  _span = _range / TRAVEL_SEGMENTS;
+  for (uint8_t i = 0; i < TRAVEL_SEGMENTS; i++) {
+    _segmentMs[Travel_Open][i] = std::max<uint32_t>(openMs[i], 1);
+    _segmentMs[Travel_Close][i] = std::max<uint32_t>(closeMs[i], 1);
+  }
+}
+
+uint8_t TravelModel::segment(int64_t position,
+                             TravelDirection direction) const {
+  // a position on a boundary belongs to the segment it is about to enter
+  int64_t index = direction == Travel_Close ? position : position - 1;
+  if (index < 0) {
+    return 0;
+  }
+  index /= _span;
+  return index >= TRAVEL_SEGMENTS ? TRAVEL_SEGMENTS - 1 : index;
+}
+
+bool TravelModel::boundary(uint8_t segment, TravelDirection direction,
+                           int64_t &position) const {
+  // the end segments reach past the range
+  if (direction == Travel_Close) {
+    position = (int64_t)(segment + 1) * _span;
+    return segment < TRAVEL_SEGMENTS - 1;
+  }
+  position = (int64_t)segment * _span;
+  return segment > 0;
+}
+
+int32_t TravelModel::advance(int32_t position, TravelDirection direction,
+                             uint32_t ms) const {
+  int64_t current = position;
+  int64_t left = ms;
+  int8_t sign = direction == Travel_Close ? 1 : -1;
+
+  while (left > 0) {
+    uint8_t index = segment(current, direction);
+    uint32_t segmentMs = _segmentMs[direction][index];
+    int64_t next;
+    if (boundary(index, direction, next) &&
+        (next - current) * sign > 0) {
+      int64_t needed = (next - current) * sign * segmentMs / _span;
+      if (needed < left) {
+        current = next;
+        left -= needed;
+        continue;
+      }
+    }
+    current += sign * left * _span / segmentMs;
+    break;
+  }
+
+  return current;
+}
+
+uint32_t TravelModel::timeTo(int32_t from, int32_t to) const {
+  TravelDirection direction = to > from ? Travel_Close : Travel_Open;
+  int8_t sign = direction == Travel_Close ? 1 : -1;
+  int64_t current = from;
+  int64_t total = 0;
+
+  while (current != to) {
+    uint8_t index = segment(current, direction);
+    int64_t next;
+    if (!boundary(index, direction, next) || (next - to) * sign > 0) {
+      next = to;
+    }
+    total += (next - current) * sign * _segmentMs[direction][index] / _span;
+    current = next;
+  }
+
+  return total;
+}
+
+uint32_t TravelModel::travelTime(TravelDirection direction) const {
+  return timeTo(direction == Travel_Close ? 0 : _range,
+                direction == Travel_Close ? _range : 0);
+}
+
+void TravelError::ran(uint32_t ms) {
+  _estimate += TRAVEL_START_ERROR + ms / TRAVEL_ERROR_RATIO;
+}
+
+void TravelError::homed() { _estimate = 0; }
+
+uint32_t TravelError::estimate() const { return _estimate; }
+
+bool TravelError::needsRehome(int32_t range) const {
+  return _estimate > (uint32_t)range / REHOME_RATIO;
+}
@@ -0,0 +1,55 @@
+#ifndef _TRAVEL_MODEL_H_
+#define _TRAVEL_MODEL_H_
+
+#include "util.h"
+#include <stdint.h>
+
+#define TRAVEL_SEGMENTS 4
+
+// relay and motor start/stop uncertainty, plus a share of each run
+#define TRAVEL_START_ERROR MSEC(20)
+#define TRAVEL_ERROR_RATIO 50
+// re-home before a partial move once the estimate exceeds 1/20 of the travel
+#define REHOME_RATIO 20
+
+enum TravelDirection { Travel_Open = 0, Travel_Close };
+
+// piecewise linear position over time, position 0 is open, range is closed.
+// the range is split into equally long segments, each with its own travel
+// time per direction. integer math only, positions outside the range use
+// the speed of the end segment.
+class TravelModel {
+  int32_t _range = 1;
+  int32_t _span = 1;
+  uint32_t _segmentMs[2][TRAVEL_SEGMENTS];
+
+  uint8_t segment(int64_t position, TravelDirection direction) const;
+  bool boundary(uint8_t segment, TravelDirection direction,
+                int64_t &position) const;
+
+public:
+  TravelModel();
+
+  void setLinear(int32_t range, uint32_t openMs, uint32_t closeMs);
+  void setSegments(int32_t range, const uint32_t *openMs,
+                   const uint32_t *closeMs);
+
+  int32_t advance(int32_t position, TravelDirection direction,
+                  uint32_t ms) const;
+  uint32_t timeTo(int32_t from, int32_t to) const;
+  uint32_t travelTime(TravelDirection direction) const;
+};
+
+// estimated error of the dead reckoned position in ms of travel, cleared
+// whenever an end stop is hit
+class TravelError {
+  uint32_t _estimate = 0;
+
+public:
+  void ran(uint32_t ms);
+  void homed();
+  uint32_t estimate() const;
+  bool needsRehome(int32_t range) const;
+};
+
+#endif
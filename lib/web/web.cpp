@@ -1,21 +1,89 @@
 #include "web.h"
+#include "metrics.h"
+#include "power.h"
 #include <WiFi.h>
 
+#define MAX_CONFIG_SIZE 8192
+#define EVENT_CLIENTS 3
+#define EVENT_QUEUE 8
+#define EVENT_POLL MSEC(250)
+
 using namespace std;
 using namespace std::placeholders;
 
 void NO_OP_REQ(AsyncWebServerRequest *req) {}
 
-Web::Web() : _server(80) {}
+Web::Web() : _server(80), _events("/api/events") {}
 
 void Web::begin(String type) {
+  _server.addMiddleware([](AsyncWebServerRequest *req, ArMiddlewareNext next) {
+    PowerScope power(Power_Web);
+    Power::interaction();
+    next();
+  });
   _server.on("/api/status", HTTP_GET, (ArRequestHandlerFunction)bind(&Web::getStatus, this, _1));
   _server.on("/api/config", HTTP_GET, (ArRequestHandlerFunction)bind(&Web::getConfig, this, _1));
   _server.on("/api/config", HTTP_POST, NO_OP_REQ, NULL,
              bind(&Web::updateConfig, this, _1, _2, _3, _4, _5));
+  _server.on("/api/config", HTTP_PATCH, NO_OP_REQ, NULL,
+             bind(&Web::patchConfig, this, _1, _2, _3, _4, _5));
+  _server.on("/metrics", HTTP_GET, (ArRequestHandlerFunction)bind(&Web::getMetrics, this, _1));
   _server.on("/api/reboot", HTTP_POST, (ArRequestHandlerFunction)bind(&Web::reboot, this, _1));
   _server.onNotFound(bind(&Web::handleNotFound, this, _1));
+  _events.onConnect(bind(&Web::eventClientConnected, this, _1));
+  _server.addHandler(&_events);
   _server.begin();
+
+  _eventsTicker.attach_ms(EVENT_POLL, Web::handleEvents, this);
+}
+
+void Web::eventClientConnected(AsyncEventSourceClient *client) {
+  // every client costs a socket and send buffers on the async_tcp task
+  if (_events.count() > EVENT_CLIENTS) {
+    client->close();
+    return;
+  }
+
+  // full status once, only deltas afterwards
+  JsonDocument json;
+  if (_appendStatus) {
+    _appendStatus(json);
+  }
+  String payload;
+  serializeJson(json, payload);
+  client->send(payload.c_str(), "status", ++_eventId);
+}
+
+void Web::handleEvents(Web *instance) {
+  Web &web = *instance;
+  if (!web._events.count() || !web._pollEvent) {
+    return;
+  }
+
+  JsonDocument json;
+  if (web._pollEvent(json)) {
+    web.sendEvent("io", json);
+  }
+}
+
+void Web::sendEvent(const char *event, JsonVariantConst doc) {
+  if (!_events.count()) {
+    return;
+  }
+
+  // a slow client must not pile up deltas, it can resync from /api/status
+  if (_events.avgPacketsWaiting() >= EVENT_QUEUE) {
+    _eventsDropped++;
+    return;
+  }
+
+  char payload[384];
+  size_t length = serializeJson(doc, payload, sizeof(payload));
+  if (length >= sizeof(payload) - 1) {
+    _eventsDropped++;
+    return;
+  }
+  _events.send(payload, event, ++_eventId);
 }
 
 void Web::handleNotFound(AsyncWebServerRequest *req) {
@@ -33,32 +101,82 @@ void Web::getStatus(AsyncWebServerRequest *req) {
   wifi["rssi"] = WiFi.RSSI();
   wifi["ip"] = WiFi.localIP().toString();
 
+  auto events = json["events"].to<JsonObject>();
+  events["clients"] = _events.count();
+  events["dropped"] = _eventsDropped;
+
   if (_appendStatus) {
     _appendStatus(json);
   }
 
-  String response;
-  serializeJson(json, response);
-  req->send(200, "application/json", response);
+  // serialize straight into the response buffers, no intermediate String
+  auto response = req->beginResponseStream("application/json");
+  serializeJson(json, *response);
+  req->send(response);
+}
+
+void Web::getMetrics(AsyncWebServerRequest *req) {
+  auto response = req->beginResponseStream("text/plain; version=0.0.4");
+  Metrics::write(*response);
+  Timers::write(*response);
+  req->send(response);
 }
 
 void Web::getConfig(AsyncWebServerRequest *req) {
-  if (_readConfig) {
-    auto config = _readConfig();
-    String response;
-    serializeJson(*config, response);
-    delete config;
-
-    req->send(200, "application/json", response);
-  } else {
+  if (!_readConfig) {
     req->send(500, "text/html", "NO GET HANDLER");
+    return;
   }
+
+  char etag[12] = "";
+  if (_configEtag) {
+    snprintf(etag, sizeof(etag), "\"%08x\"", (unsigned int)_configEtag());
+    if (req->hasHeader("If-None-Match") &&
+        req->header("If-None-Match") == etag) {
+      auto response = req->beginResponse(304);
+      response->addHeader("ETag", etag);
+      req->send(response);
+      return;
+    }
+  }
+
+  auto response = req->beginResponseStream("application/json");
+  _readConfig(*response);
+  if (etag[0]) {
+    response->addHeader("ETag", etag);
+    response->addHeader("Cache-Control", "no-cache");
+  }
+  req->send(response);
 }
 
 void Web::updateConfig(AsyncWebServerRequest *req, uint8_t *data, size_t len,
                        size_t index, size_t total) {
+  receiveConfig(req, data, len, index, total, _setConfig);
+}
+
+void Web::patchConfig(AsyncWebServerRequest *req, uint8_t *data, size_t len,
+                      size_t index, size_t total) {
+  receiveConfig(req, data, len, index, total, _patchConfig);
+}
+
+void Web::receiveConfig(AsyncWebServerRequest *req, uint8_t *data, size_t len,
+                        size_t index, size_t total,
+                        SetConfigHandler &handler) {
+  if (total > MAX_CONFIG_SIZE) {
+    if (!index) {
+      req->send(413);
+    }
+    return;
+  }
+
   if (!index) {
     req->_tempObject = malloc(total + 1);
+    if (!req->_tempObject) {
+      req->send(500, "text/html", "OUT OF MEMORY");
+    }
+  }
+  if (!req->_tempObject) {
+    return;
   }
 
   uint8_t *dest = &((uint8_t *)req->_tempObject)[index];
@@ -68,11 +186,12 @@ void Web::updateConfig(AsyncWebServerRequest *req, uint8_t *data, size_t len,
     char *str = (char *)req->_tempObject;
     str[total] = 0;
 
-    if (_setConfig) {
-      _setConfig(str);
+    if (!handler) {
+      req->send(500, "text/html", "NO SET HANDLER");
+    } else if (handler(str)) {
       req->send(204);
     } else {
-      req->send(500, "text/html", "NO SET HANDLER");
+      req->send(400, "text/html", "INVALID CONFIG");
     }
 
     free(req->_tempObject);
@@ -90,6 +209,16 @@ Web &Web::onReadConfig(ReadConfigHandler readConfig) {
   return *this;
 }
 
+Web &Web::onPatchConfig(SetConfigHandler patchConfig) {
+  _patchConfig = patchConfig;
+  return *this;
+}
+
+Web &Web::onConfigEtag(ConfigEtagHandler configEtag) {
+  _configEtag = configEtag;
+  return *this;
+}
+
 Web &Web::onSetConfig(SetConfigHandler setConfig) {
   _setConfig = setConfig;
   return *this;
@@ -98,4 +227,9 @@ Web &Web::onSetConfig(SetConfigHandler setConfig) {
 Web &Web::onAppendStatus(AppendStatusHandler appendStatus) {
   _appendStatus = appendStatus;
   return *this;
+}
+
+Web &Web::onPollEvent(PollEventHandler pollEvent) {
+  _pollEvent = pollEvent;
+  return *this;
 }
\ No newline at end of file
@@ -2,37 +2,57 @@
 #define _WEB_H_
 
 #include "io.h"
+#include "timers.h"
 #include <Arduino.h>
 #include <ArduinoJson.h>
 #include <ESPAsyncWebServer.h>
-#include <Ticker.h>
 
-typedef std::function<JsonDocument *()> ReadConfigHandler;
-typedef std::function<void(String config)> SetConfigHandler;
+typedef std::function<void(Print &out)> ReadConfigHandler;
+typedef std::function<uint32_t()> ConfigEtagHandler;
+typedef std::function<bool(const char *config)> SetConfigHandler;
 typedef std::function<void(JsonVariant doc)> AppendStatusHandler;
+typedef std::function<bool(JsonVariant doc)> PollEventHandler;
 
 class Web {
 private:
   AsyncWebServer _server;
+  AsyncEventSource _events;
   ReadConfigHandler _readConfig;
+  ConfigEtagHandler _configEtag;
   SetConfigHandler _setConfig;
+  SetConfigHandler _patchConfig;
   AppendStatusHandler _appendStatus;
+  PollEventHandler _pollEvent;
   String _type;
-  Ticker _rebootTicker;
+  Timer _rebootTicker{"reboot"};
+  Timer _eventsTicker{"web-events"};
+  uint32_t _eventId = 0, _eventsDropped = 0;
 
   void getConfig(AsyncWebServerRequest *req);
   void getStatus(AsyncWebServerRequest *req);
+  void getMetrics(AsyncWebServerRequest *req);
   void updateConfig(AsyncWebServerRequest *req, uint8_t *data, size_t len,
                     size_t index, size_t total);
+  void patchConfig(AsyncWebServerRequest *req, uint8_t *data, size_t len,
+                   size_t index, size_t total);
+  void receiveConfig(AsyncWebServerRequest *req, uint8_t *data, size_t len,
+                     size_t index, size_t total, SetConfigHandler &handler);
   void reboot(AsyncWebServerRequest *req);
   void handleNotFound(AsyncWebServerRequest *req);
+  void eventClientConnected(AsyncEventSourceClient *client);
+  static void handleEvents(Web *instance);
 
 public:
   Web();
 
   Web &onReadConfig(ReadConfigHandler readConfig);
+  Web &onConfigEtag(ConfigEtagHandler configEtag);
   Web &onSetConfig(SetConfigHandler setConfig);
+  Web &onPatchConfig(SetConfigHandler patchConfig);
   Web &onAppendStatus(AppendStatusHandler appendStatus);
+  Web &onPollEvent(PollEventHandler pollEvent);
+
+  void sendEvent(const char *event, JsonVariantConst doc);
 
   void begin(String type);
 };
@@ -0,0 +1,150 @@
+#include "wifi-connect.h"
+#include "boot-timeline.h"
+#include <WiFi.h>
+#include <esp_wifi.h>
+
+#define AP_MAGIC 0x41504331
+#define NVS_KEY "ap"
+#define FAST_CONNECT_MISSES 3
+
+struct AccessPoint {
+  uint32_t magic;
+  uint8_t bssid[6];
+  uint8_t channel;
+};
+
+// last associated AP, NVS copy is only used after power loss
+RTC_NOINIT_ATTR static AccessPoint cachedAccessPoint;
+
+void WifiConnect::begin() {
+  _preferences.begin("ha-wifi");
+
+  if (cachedAccessPoint.magic != AP_MAGIC) {
+    AccessPoint stored;
+    if (_preferences.getBytes(NVS_KEY, &stored, sizeof(stored)) ==
+            sizeof(stored) &&
+        stored.magic == AP_MAGIC) {
+      cachedAccessPoint = stored;
+    } else {
+      cachedAccessPoint.magic = 0;
+    }
+  }
+
+  WiFi.onEvent([this](arduino_event_id_t event, arduino_event_info_t info) {
+    switch (event) {
+    case ARDUINO_EVENT_WIFI_STA_CONNECTED:
+      _associated = true;
+      _fastConnectMisses = 0;
+      BootTimeline::mark(Boot_Associated);
+      storeAccessPoint(info.wifi_sta_connected.bssid,
+                       info.wifi_sta_connected.channel);
+      break;
+    case ARDUINO_EVENT_WIFI_STA_GOT_IP:
+      BootTimeline::mark(Boot_GotIp);
+      if (_gotIp) {
+        _gotIp();
+      }
+      break;
+    case ARDUINO_EVENT_WIFI_STA_DISCONNECTED: {
+      uint8_t reason = info.wifi_sta_disconnected.reason;
+      if (reason == WIFI_REASON_ASSOC_LEAVE) {
+        // our own disconnect in reconnect, the new attempt is under way
+        break;
+      }
+      if (_fastConnect && !_associated) {
+        _fastConnectFailures++;
+        if (reason == WIFI_REASON_NO_AP_FOUND ||
+            ++_fastConnectMisses >= FAST_CONNECT_MISSES) {
+          // AP moved to another channel or got replaced, scan next time
+          _fastConnectMisses = 0;
+          forgetAccessPoint();
+        }
+      }
+      _fastConnect = false;
+      _associated = false;
+      break;
+    }
+    default:
+      break;
+    }
+  });
+}
+
+void WifiConnect::configure(const WifiConfig &config) {
+  _staticIp = _ip.fromString(config.ip) && _gateway.fromString(config.gateway) &&
+              _subnet.fromString(config.subnet);
+  if (!_dns.fromString(config.dns)) {
+    _dns = _gateway;
+  }
+}
+
+void WifiConnect::connect() {
+  if (_staticIp) {
+    WiFi.config(_ip, _gateway, _subnet, _dns);
+  } else {
+    // back to dhcp when the static address got removed
+    WiFi.config(INADDR_NONE, INADDR_NONE, INADDR_NONE);
+  }
+
+  _fastConnect = cachedAccessPoint.magic == AP_MAGIC;
+  if (_fastConnect) {
+    connectWith(cachedAccessPoint.bssid, cachedAccessPoint.channel);
+  } else {
+    connectWith(nullptr, 0);
+  }
+}
+
+void WifiConnect::reconnect() {
+  WiFi.mode(WIFI_MODE_STA);
+  WiFi.disconnect();
+  connect();
+}
+
+void WifiConnect::connectWith(const uint8_t *bssid, uint8_t channel) {
+  _associated = false;
+
+  wifi_config_t config;
+  if (esp_wifi_get_config(WIFI_IF_STA, &config) != ESP_OK ||
+      !config.sta.ssid[0]) {
+    _fastConnect = false;
+    WiFi.begin();
+    return;
+  }
+
+  char ssid[sizeof(config.sta.ssid) + 1] = {};
+  char password[sizeof(config.sta.password) + 1] = {};
+  memcpy(ssid, config.sta.ssid, sizeof(config.sta.ssid));
+  memcpy(password, config.sta.password, sizeof(config.sta.password));
+
+  // skips the all-channel scan when bssid/channel are known, passing none
+  // also clears a previously stored bssid lock
+  WiFi.begin(ssid, password, channel, bssid);
+}
+
+void WifiConnect::storeAccessPoint(const uint8_t *bssid, uint8_t channel) {
+  if (cachedAccessPoint.magic == AP_MAGIC &&
+      cachedAccessPoint.channel == channel &&
+      !memcmp(cachedAccessPoint.bssid, bssid, sizeof(cachedAccessPoint.bssid))) {
+    return;
+  }
+
+  memcpy(cachedAccessPoint.bssid, bssid, sizeof(cachedAccessPoint.bssid));
+  cachedAccessPoint.channel = channel;
+  cachedAccessPoint.magic = AP_MAGIC;
+  _preferences.putBytes(NVS_KEY, &cachedAccessPoint, sizeof(cachedAccessPoint));
+}
+
+void WifiConnect::forgetAccessPoint() {
+  cachedAccessPoint.magic = 0;
+  _preferences.remove(NVS_KEY);
+}
+
+void WifiConnect::onGotIp(GotIpHandler handler) { _gotIp = handler; }
+
+void WifiConnect::appendStatus(JsonVariant doc) const {
+  auto wifi = doc["wifi"];
+  wifi["staticIp"] = _staticIp;
+  wifi["cachedChannel"] =
+      cachedAccessPoint.magic == AP_MAGIC ? cachedAccessPoint.channel : 0;
+  wifi["fastConnectFailures"] = _fastConnectFailures;
+}
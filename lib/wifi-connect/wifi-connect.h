@@ -0,0 +1,35 @@
+#ifndef _WIFI_CONNECT_H_
+#define _WIFI_CONNECT_H_
+
+#include "config-model.h"
+#include <ArduinoJson.h>
+#include <IPAddress.h>
+#include <Preferences.h>
+
+typedef std::function<void()> GotIpHandler;
+
+class WifiConnect {
+  Preferences _preferences;
+  IPAddress _ip, _gateway, _subnet, _dns;
+  bool _staticIp = false;
+  bool _fastConnect = false;
+  bool _associated = false;
+  uint32_t _fastConnectFailures = 0;
+  // in a row, a single failed association keeps the AP
+  uint8_t _fastConnectMisses = 0;
+  GotIpHandler _gotIp;
+
+  void connectWith(const uint8_t *bssid, uint8_t channel);
+  void storeAccessPoint(const uint8_t *bssid, uint8_t channel);
+  void forgetAccessPoint();
+
+public:
+  void begin();
+  void configure(const WifiConfig &config);
+  void connect();
+  void reconnect();
+  void onGotIp(GotIpHandler handler);
+  void appendStatus(JsonVariant doc) const;
+};
+
+#endif
@@ -0,0 +1,60 @@
+#include "zero-cross.h"
+#include <esp_timer.h>
+
+// 50 and 60 Hz, with one or two detector edges per cycle
+#define MIN_PERIOD 7000
+#define MAX_PERIOD 22000
+// a single edge per cycle, the crossing in between is interpolated
+#define FULL_CYCLE 12500
+
+void ZeroCross::begin(int8_t pin) {
+  if (pin == _pin) {
+    return;
+  }
+
+  end();
+  _pin = pin;
+  if (_pin != -1) {
+    pinMode(_pin, INPUT);
+    attachInterruptArg(_pin, ZeroCross::handleEdge, this, RISING);
+  }
+}
+
+void ZeroCross::end() {
+  if (_pin != -1) {
+    detachInterrupt(_pin);
+    _pin = -1;
+  }
+  _last = 0;
+  _period = 0;
+}
+
+void IRAM_ATTR ZeroCross::handleEdge(void *instance) {
+  ZeroCross &me = *(ZeroCross *)instance;
+  uint32_t now = esp_timer_get_time();
+  uint32_t since = now - me._last;
+
+  // ringing on the detector, keep the first edge
+  if (since < MIN_PERIOD) {
+    return;
+  }
+
+  me._period = since <= MAX_PERIOD ? since : 0;
+  me._last = now;
+}
+
+int32_t ZeroCross::untilCrossing(uint32_t minUs) const {
+  uint32_t last = _last;
+  uint32_t period = _period;
+  uint32_t since = (uint32_t)esp_timer_get_time() - last;
+  if (!period || since >= 3 * period) {
+    return -1;
+  }
+
+  uint32_t half = period > FULL_CYCLE ? period / 2 : period;
+  uint32_t until = half - since % half;
+  while (until < minUs) {
+    until += half;
+  }
+  return until;
+}
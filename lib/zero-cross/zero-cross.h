@@ -0,0 +1,24 @@
+#ifndef _ZERO_CROSS_H_
+#define _ZERO_CROSS_H_
+
+#include <Arduino.h>
+
+// times mains zero crossings from a detector pin, edges are taken in an ISR
+class ZeroCross {
+  int8_t _pin = -1;
+  // low 32 bits of the esp_timer clock, differences survive the wrap
+  volatile uint32_t _last = 0;
+  volatile uint32_t _period = 0;
+
+  static void IRAM_ATTR handleEdge(void *instance);
+
+public:
+  void begin(int8_t pin);
+  void end();
+
+  // microseconds until the next crossing at least minUs away, or -1 without
+  // a recent, plausible crossing
+  int32_t untilCrossing(uint32_t minUs) const;
+};
+
+#endif
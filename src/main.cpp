@@ -1,103 +1,327 @@
+#include "boot-timeline.h"
 #include "configuration.h"
 #include "io.h"
-#include "switch-blinds.h"
+#include "power.h"
+#include "state-store.h"
 #include "switch-common.h"
-#include "switch-dimmer.h"
-#include "switch-onoff.h"
+#include "timers.h"
 #include "util.h"
 #include "web.h"
+#include "wifi-connect.h"
 #include <Arduino.h>
 #include <ArduinoJson.h>
 #include <ArduinoOTA.h>
 #include <AsyncJson.h>
 #include <WiFi.h>
 
+// single type builds define one of these, without any all types are built in
+#if !defined(SWITCH_TYPE_DIMMER) && !defined(SWITCH_TYPE_ONOFF) &&            \
+    !defined(SWITCH_TYPE_BLINDS)
+#define SWITCH_TYPE_DIMMER
+#define SWITCH_TYPE_ONOFF
+#define SWITCH_TYPE_BLINDS
+#define FIRMWARE_TYPE "multi"
+#endif
+
+#ifdef SWITCH_TYPE_DIMMER
+#include "switch-dimmer.h"
+#ifndef FIRMWARE_TYPE
+#define FIRMWARE_TYPE "dimmer"
+#endif
+#endif
+#ifdef SWITCH_TYPE_ONOFF
+#include "switch-onoff.h"
+#ifndef FIRMWARE_TYPE
+#define FIRMWARE_TYPE "switch"
+#endif
+#endif
+#ifdef SWITCH_TYPE_BLINDS
+#include "switch-blinds.h"
+#ifndef FIRMWARE_TYPE
+#define FIRMWARE_TYPE "blinds"
+#endif
+#endif
+
 Io io;
-SwitchCommon switchCommon(io);
+WifiConnect wifi;
+SwitchCommon switchCommon(io, wifi);
+#ifdef SWITCH_TYPE_DIMMER
 SwitchDimmer switchDimmer(io);
+#endif
+#ifdef SWITCH_TYPE_ONOFF
 SwitchOnOff switchOnOff(io);
+#endif
+#ifdef SWITCH_TYPE_BLINDS
 SwitchBlinds switchBlinds(io);
+#endif
 
-Ticker reboot;
+Timer reboot("reboot");
 Web web;
 String type;
+DeviceType activeType = Device_Undefined;
 Configuration configuration;
+StateStore stateStore;
+
+#ifdef SWITCH_TYPE_BLINDS
+// measured on the esp_timer or MQTT task, persisted from the loop
+struct CalibratedCurve {
+  bool pending = false;
+  uint8_t motor;
+  uint32_t openMs[CONFIG_TRAVEL_SEGMENTS];
+  uint32_t closeMs[CONFIG_TRAVEL_SEGMENTS];
+};
+CalibratedCurve calibratedCurve;
+portMUX_TYPE calibratedCurveLock = portMUX_INITIALIZER_UNLOCKED;
+
+void persistCalibratedCurve() {
+  CalibratedCurve measured;
+  portENTER_CRITICAL(&calibratedCurveLock);
+  measured = calibratedCurve;
+  calibratedCurve.pending = false;
+  portEXIT_CRITICAL(&calibratedCurveLock);
+  if (!measured.pending) {
+    return;
+  }
+
+  // the web server may replace the config meanwhile
+  ConfigurationLock scope(configuration);
+  JsonDocument patch;
+  JsonObject blinds = patch["blinds"].to<JsonObject>();
+  JsonObject target = blinds;
+  auto motors = configuration.json()["blinds"]["motors"];
+  if (motors.is<JsonArrayConst>()) {
+    // a merge patch replaces arrays as a whole
+    blinds["motors"].set(motors);
+    target = blinds["motors"][measured.motor].as<JsonObject>();
+  }
+  auto curve = target["curve"].to<JsonObject>();
+  for (uint8_t i = 0; i < CONFIG_TRAVEL_SEGMENTS; i++) {
+    curve["open"].add(measured.openMs[i]);
+    curve["close"].add(measured.closeMs[i]);
+  }
+  String json;
+  serializeJson(patch, json);
+  // the blinds run on the new curve already, only persist it
+  configuration.patch(json.c_str());
+}
+#endif
+
+void appendState(JsonVariant state) {
+  switch (activeType) {
+#ifdef SWITCH_TYPE_DIMMER
+  case Device_Dimmer:
+    switchDimmer.appendState(state);
+    break;
+#endif
+#ifdef SWITCH_TYPE_ONOFF
+  case Device_Switch:
+    switchOnOff.appendState(state);
+    break;
+#endif
+#ifdef SWITCH_TYPE_BLINDS
+  case Device_Blinds:
+    switchBlinds.appendState(state);
+    break;
+#endif
+  default:
+    break;
+  }
+}
+
+void updateState(JsonVariantConst state, bool isFromStoredState) {
+  switch (activeType) {
+#ifdef SWITCH_TYPE_DIMMER
+  case Device_Dimmer:
+    switchDimmer.updateState(state, isFromStoredState);
+    break;
+#endif
+#ifdef SWITCH_TYPE_ONOFF
+  case Device_Switch:
+    switchOnOff.updateState(state, isFromStoredState);
+    break;
+#endif
+#ifdef SWITCH_TYPE_BLINDS
+  case Device_Blinds:
+    switchBlinds.updateState(state, isFromStoredState);
+    break;
+#endif
+  default:
+    break;
+  }
+}
+
+void stateChanged() {
+  JsonDocument state;
+  appendState(state);
+  stateStore.save(state);
+  switchCommon.publishState();
+  web.sendEvent("state", state);
+}
+
+void restoreState() {
+  JsonDocument state;
+  if (stateStore.restore(state)) {
+    updateState(state, true);
+    switchCommon.skipStateRecall();
+  }
+}
+
+// false when the switch could not release its pins
+bool endSwitch(DeviceType deviceType) {
+  switch (deviceType) {
+#ifdef SWITCH_TYPE_DIMMER
+  case Device_Dimmer:
+    return switchDimmer.end();
+#endif
+#ifdef SWITCH_TYPE_ONOFF
+  case Device_Switch:
+    switchOnOff.end();
+    break;
+#endif
+#ifdef SWITCH_TYPE_BLINDS
+  case Device_Blinds:
+    switchBlinds.end();
+    break;
+#endif
+  default:
+    break;
+  }
+  return true;
+}
 
 void applyConfiguration(bool init) {
-  auto config = configuration.read();
+  // runs on the loop and the web server, the config must stay put meanwhile
+  ConfigurationLock scope(configuration);
 
-  static String lastHostName;
-  String hostName = (*config)["mdns"]["host"] | "";
-  bool needsReboot = false;
+  // nothing to do when the stored config did not change
+  static uint32_t appliedGeneration = 0;
+  if (configuration.generation() == appliedGeneration) {
+    return;
+  }
+  appliedGeneration = configuration.generation();
 
+  const DeviceConfig &config = configuration.get();
   if (init) {
-    lastHostName = hostName;
-    if (hostName.length()) {
-      WiFi.setHostname(hostName.c_str());
-    }
+    BootTimeline::mark(Boot_ConfigRead);
+  }
 
-    WiFi.mode(WIFI_STA);
-    WiFi.setSleep(true);
-    WiFi.begin();
+  String hostName = config.mdns.host;
+  bool needsReboot = false;
+
+  // dhcp picks a renamed host up with the next lease
+  if (hostName.length()) {
+    WiFi.setHostname(hostName.c_str());
+  }
 
-  } else {
-    needsReboot |= lastHostName != hostName;
+  if (init) {
+    WiFi.mode(WIFI_STA);
+  } else if (config.type != activeType && !endSwitch(activeType)) {
+    // the old switch still owns its pins, start over with the new config
+    reboot.once_ms(1500, []() { ESP.restart(); });
+    return;
   }
 
-  needsReboot |= switchCommon.configure(*config);
-  String configType = (*config)["type"] | "undefined";
+  Power::configure(config.power);
+  wifi.configure(config.wifi);
+  switchCommon.configure(config, configuration.json());
 
-  if (configType == "dimmer") {
-    needsReboot |= switchDimmer.configure((*config)["dimmer"]);
-  } else if (configType == "switch") {
-    needsReboot |= switchOnOff.configure((*config)["switch"]);
-  } else if (configType == "blinds") {
-    needsReboot |= switchBlinds.configure((*config)["blinds"]);
+  // a type this firmware was not built for stays inactive
+  activeType = Device_Undefined;
+  switch (config.type) {
+#ifdef SWITCH_TYPE_DIMMER
+  case Device_Dimmer:
+    needsReboot |= switchDimmer.configure(config.dimmer);
+    activeType = config.type;
+    break;
+#endif
+#ifdef SWITCH_TYPE_ONOFF
+  case Device_Switch:
+    switchOnOff.configure(config.onOff);
+    activeType = config.type;
+    break;
+#endif
+#ifdef SWITCH_TYPE_BLINDS
+  case Device_Blinds:
+    switchBlinds.configure(config.blinds);
+    activeType = config.type;
+    break;
+#endif
+  default:
+    break;
   }
 
-  needsReboot |= type != configType;
-  type = configType;
+  type = config.typeName;
 
   if (!init && needsReboot) {
     reboot.once_ms(1500, []() { ESP.restart(); });
   }
+}
 
-  delete config;
+bool configurationUpdated(ConfigUpdate result) {
+  if (result == Config_Changed) {
+    applyConfiguration(false);
+  }
+  return result != Config_Invalid;
 }
 
 void setup() {
-  setCpuFrequencyMhz(80);
+  Timers::begin();
   configuration.begin();
+  stateStore.begin();
+  wifi.begin();
   applyConfiguration(true);
+  restoreState();
+  wifi.connect();
+
   web.onAppendStatus([](JsonVariant doc) {
     doc["type"] = type;
+    doc["firmware"] = FIRMWARE_TYPE;
     switchCommon.appendStatus(doc);
-
-    auto state = doc["state"].to<JsonObject>();
-    switchDimmer.appendState(state);
-    switchOnOff.appendState(state);
-    switchBlinds.appendState(state);
+    stateStore.appendStatus(doc);
+    Power::appendStatus(doc["power"].to<JsonObject>());
+    configuration.appendStatus(doc["config"].to<JsonObject>());
+    appendState(doc["state"].to<JsonObject>());
   });
-  switchCommon.onGetState([](JsonVariant state) {
-    switchDimmer.appendState(state);
-    switchOnOff.appendState(state);
-    switchBlinds.appendState(state);
+  web.onPollEvent([](JsonVariant doc) {
+    static IoSnapshot lastSnapshot = {};
+    return io.appendStatusIfChanged(doc, lastSnapshot);
   });
-  switchDimmer.onStateChanged([] { switchCommon.publishState(); });
-  switchOnOff.onStateChanged([] { switchCommon.publishState(); });
-  switchBlinds.onStateChanged([] { switchCommon.publishState(); });
-  switchCommon.onStateChanged(
-      [](JsonVariantConst state, bool isFromStoredState) {
-        switchDimmer.updateState(state, isFromStoredState);
-        switchOnOff.updateState(state, isFromStoredState);
-        switchBlinds.updateState(state, isFromStoredState);
-      });
-  web.onReadConfig([] { return configuration.read(); });
-  web.onSetConfig([](String config) {
-    configuration.update(config);
-    applyConfiguration(false);
+  switchCommon.onGetState(appendState);
+#ifdef SWITCH_TYPE_DIMMER
+  switchDimmer.onStateChanged(stateChanged);
+#endif
+#ifdef SWITCH_TYPE_ONOFF
+  switchOnOff.onStateChanged(stateChanged);
+#endif
+#ifdef SWITCH_TYPE_BLINDS
+  switchBlinds.onStateChanged(stateChanged);
+  switchBlinds.onCalibrated([](uint8_t motor, const uint32_t *openMs,
+                                const uint32_t *closeMs) {
+    portENTER_CRITICAL(&calibratedCurveLock);
+    calibratedCurve.pending = true;
+    calibratedCurve.motor = motor;
+    memcpy(calibratedCurve.openMs, openMs, sizeof(calibratedCurve.openMs));
+    memcpy(calibratedCurve.closeMs, closeMs, sizeof(calibratedCurve.closeMs));
+    portEXIT_CRITICAL(&calibratedCurveLock);
+  });
+#endif
+  switchCommon.onStateChanged(updateState);
+  web.onReadConfig([](Print &out) { configuration.write(out); })
+      .onConfigEtag([] { return configuration.etag(); });
+  web.onSetConfig([](const char *config) {
+    return configurationUpdated(configuration.update(config));
+  });
+  web.onPatchConfig([](const char *patch) {
+    return configurationUpdated(configuration.patch(patch));
   });
   web.begin(type);
 }
 
-void loop() { ArduinoOTA.handle(); }
\ No newline at end of file
+void loop() {
+  ArduinoOTA.handle();
+#ifdef SWITCH_TYPE_BLINDS
+  persistCalibratedCurve();
+#endif
+  // everything else runs on timers and tasks, let the idle task sleep
+  delay(MSEC(100));
+}
\ No newline at end of file
@@ -0,0 +1,151 @@
+#include "group-codec.h"
+#include <string.h>
+#include <unity.h>
+
+void setUp() {}
+void tearDown() {}
+
+static GroupMessage stateMessage() {
+  GroupMessage message = {};
+  message.type = Group_State;
+  message.group = groupId("hall");
+  message.sender = 0xA1B2C3D4;
+  message.sequence = 0xFFFE;
+  message.fields = GroupField_Channels | 3 << GROUP_CHANNELS_SHIFT |
+                   GroupField_Brightness;
+  message.on = 0x05;
+  message.brightness = 42;
+  return message;
+}
+
+static void test_state_round_trip() {
+  GroupMessage sent = stateMessage();
+  uint8_t buffer[GROUP_PACKET_SIZE];
+  TEST_ASSERT_EQUAL(GROUP_PACKET_SIZE,
+                    encodeGroupMessage(sent, buffer, sizeof(buffer)));
+
+  GroupMessage received = {};
+  TEST_ASSERT_TRUE(decodeGroupMessage(buffer, sizeof(buffer), received));
+  TEST_ASSERT_EQUAL(Group_State, received.type);
+  TEST_ASSERT_EQUAL(sent.group, received.group);
+  TEST_ASSERT_EQUAL(sent.sender, received.sender);
+  TEST_ASSERT_EQUAL(sent.sequence, received.sequence);
+  TEST_ASSERT_EQUAL(sent.fields, received.fields);
+  TEST_ASSERT_EQUAL(sent.on, received.on);
+  TEST_ASSERT_EQUAL(sent.brightness, received.brightness);
+}
+
+static void test_touch_round_trip() {
+  GroupMessage sent = {};
+  sent.type = Group_Touch;
+  sent.group = groupId("hall");
+  sent.sender = 7;
+  sent.sequence = 1;
+  sent.key = 2;
+  sent.event = GroupTouch_Long;
+  uint8_t buffer[GROUP_PACKET_SIZE];
+  encodeGroupMessage(sent, buffer, sizeof(buffer));
+
+  GroupMessage received = {};
+  TEST_ASSERT_TRUE(decodeGroupMessage(buffer, sizeof(buffer), received));
+  TEST_ASSERT_EQUAL(Group_Touch, received.type);
+  TEST_ASSERT_EQUAL(2, received.key);
+  TEST_ASSERT_EQUAL(GroupTouch_Long, received.event);
+}
+
+static void test_encode_needs_room() {
+  uint8_t buffer[GROUP_PACKET_SIZE];
+  TEST_ASSERT_EQUAL(0, encodeGroupMessage(stateMessage(), buffer,
+                                          GROUP_PACKET_SIZE - 1));
+}
+
+static void test_rejects_bad_length() {
+  uint8_t buffer[GROUP_PACKET_SIZE + 1] = {};
+  encodeGroupMessage(stateMessage(), buffer, sizeof(buffer));
+
+  GroupMessage received;
+  TEST_ASSERT_FALSE(
+      decodeGroupMessage(buffer, GROUP_PACKET_SIZE - 1, received));
+  TEST_ASSERT_FALSE(
+      decodeGroupMessage(buffer, GROUP_PACKET_SIZE + 1, received));
+  TEST_ASSERT_FALSE(decodeGroupMessage(buffer, 0, received));
+}
+
+static void test_rejects_bad_crc() {
+  uint8_t buffer[GROUP_PACKET_SIZE];
+  encodeGroupMessage(stateMessage(), buffer, sizeof(buffer));
+
+  GroupMessage received;
+  // every single bit flip is caught
+  for (size_t i = 0; i < GROUP_PACKET_SIZE * 8; i++) {
+    buffer[i / 8] ^= 1 << i % 8;
+    TEST_ASSERT_FALSE(decodeGroupMessage(buffer, sizeof(buffer), received));
+    buffer[i / 8] ^= 1 << i % 8;
+  }
+  TEST_ASSERT_TRUE(decodeGroupMessage(buffer, sizeof(buffer), received));
+}
+
+static void test_rejects_other_versions() {
+  uint8_t buffer[GROUP_PACKET_SIZE];
+  encodeGroupMessage(stateMessage(), buffer, sizeof(buffer));
+  buffer[2] = GROUP_PROTOCOL_VERSION + 1;
+  uint16_t crc = groupCrc(buffer, GROUP_PACKET_SIZE - 2);
+  buffer[GROUP_PACKET_SIZE - 2] = crc;
+  buffer[GROUP_PACKET_SIZE - 1] = crc >> 8;
+
+  GroupMessage received;
+  TEST_ASSERT_FALSE(decodeGroupMessage(buffer, sizeof(buffer), received));
+}
+
+static void test_filter_drops_replays() {
+  GroupSequenceFilter filter;
+  TEST_ASSERT_TRUE(filter.accept(1, 100));
+  TEST_ASSERT_FALSE(filter.accept(1, 100));
+  // reordered within the window
+  TEST_ASSERT_TRUE(filter.accept(1, 102));
+  TEST_ASSERT_FALSE(filter.accept(1, 101));
+  // other senders count on their own
+  TEST_ASSERT_TRUE(filter.accept(2, 100));
+}
+
+static void test_filter_sequence_wraps() {
+  GroupSequenceFilter filter;
+  TEST_ASSERT_TRUE(filter.accept(1, 0xFFFE));
+  TEST_ASSERT_TRUE(filter.accept(1, 0xFFFF));
+  TEST_ASSERT_TRUE(filter.accept(1, 0));
+  TEST_ASSERT_TRUE(filter.accept(1, 1));
+  TEST_ASSERT_FALSE(filter.accept(1, 0xFFFF));
+}
+
+static void test_filter_sender_restart() {
+  GroupSequenceFilter filter;
+  TEST_ASSERT_TRUE(filter.accept(1, 5000));
+  // far behind, the sender restarted with a new random sequence
+  TEST_ASSERT_TRUE(filter.accept(1, 1000));
+  TEST_ASSERT_TRUE(filter.accept(1, 1001));
+}
+
+static void test_filter_forgets_oldest_sender() {
+  GroupSequenceFilter filter;
+  for (uint32_t sender = 1; sender <= GROUP_SENDERS + 1; sender++) {
+    TEST_ASSERT_TRUE(filter.accept(sender, 10));
+  }
+  // sender 1 was evicted, its replay can't be told apart any more
+  TEST_ASSERT_TRUE(filter.accept(1, 10));
+  TEST_ASSERT_FALSE(filter.accept(GROUP_SENDERS + 1, 10));
+}
+
+int main() {
+  UNITY_BEGIN();
+  RUN_TEST(test_state_round_trip);
+  RUN_TEST(test_touch_round_trip);
+  RUN_TEST(test_encode_needs_room);
+  RUN_TEST(test_rejects_bad_length);
+  RUN_TEST(test_rejects_bad_crc);
+  RUN_TEST(test_rejects_other_versions);
+  RUN_TEST(test_filter_drops_replays);
+  RUN_TEST(test_filter_sequence_wraps);
+  RUN_TEST(test_filter_sender_restart);
+  RUN_TEST(test_filter_forgets_oldest_sender);
+  return UNITY_END();
+}
@@ -0,0 +1,209 @@
+#include "timer-wheel.h"
+#include <unity.h>
+#include <vector>
+
+#define NODES 1000
+
+void setUp() {}
+void tearDown() {}
+
+static uint32_t seed = 0x57484545;
+
+static uint32_t nextRandom(uint32_t limit) {
+  // xorshift, the runs are reproducible
+  seed ^= seed << 13;
+  seed ^= seed >> 17;
+  seed ^= seed << 5;
+  return seed % limit;
+}
+
+// fake clock, jumps straight to the next due time like the esp_timer does
+struct Clock {
+  TimerWheel wheel;
+  uint32_t now;
+
+  explicit Clock(uint32_t start) : now(start) {}
+
+  void add(TimerNode &node, uint32_t in) {
+    node.due = now + in;
+    wheel.add(&node, now);
+  }
+
+  bool advance() {
+    uint32_t until = wheel.untilNext(now);
+    if (until == UINT32_MAX) {
+      return false;
+    }
+    now += until;
+    return true;
+  }
+};
+
+static void test_empty() {
+  Clock clock(1000);
+  TEST_ASSERT_EQUAL_UINT32(UINT32_MAX, clock.wheel.untilNext(clock.now));
+  TEST_ASSERT_NULL(clock.wheel.popDue(clock.now));
+}
+
+static void test_fires_on_time_across_levels() {
+  // both sides of every level boundary, the far ones cascade down
+  const uint32_t delays[] = {0,    1,      63,      64,      65,     4095,
+                             4096, 262143, 262144,  300000,  16777215,
+                             16777216, 100000000};
+  const size_t count = sizeof(delays) / sizeof(delays[0]);
+  TimerNode nodes[count];
+  Clock clock(5000);
+  for (size_t i = 0; i < count; i++) {
+    clock.add(nodes[i], delays[i]);
+  }
+
+  size_t fired = 0;
+  while (clock.advance()) {
+    TimerNode *node;
+    while ((node = clock.wheel.popDue(clock.now))) {
+      TEST_ASSERT_EQUAL_PTR(&nodes[fired], node);
+      TEST_ASSERT_EQUAL_UINT32(node->due, clock.now);
+      TEST_ASSERT_FALSE(TimerWheel::linked(node));
+      fired++;
+    }
+  }
+  TEST_ASSERT_EQUAL(count, fired);
+}
+
+static void test_not_early() {
+  TimerNode node;
+  Clock clock(0);
+  clock.add(node, 300000);
+  TEST_ASSERT_EQUAL_UINT32(300000, clock.wheel.untilNext(clock.now));
+  TEST_ASSERT_NULL(clock.wheel.popDue(299999));
+  TEST_ASSERT_TRUE(TimerWheel::linked(&node));
+  TEST_ASSERT_EQUAL_UINT32(1, clock.wheel.untilNext(299999));
+  TEST_ASSERT_EQUAL_PTR(&node, clock.wheel.popDue(300000));
+}
+
+static void test_late_poll() {
+  // a late wakeup hands out everything that is due, in order
+  TimerNode nodes[3];
+  Clock clock(0);
+  clock.add(nodes[0], 10);
+  clock.add(nodes[1], 5000);
+  clock.add(nodes[2], 90000);
+  TEST_ASSERT_EQUAL_PTR(&nodes[0], clock.wheel.popDue(100000));
+  TEST_ASSERT_EQUAL_PTR(&nodes[1], clock.wheel.popDue(100000));
+  TEST_ASSERT_EQUAL_PTR(&nodes[2], clock.wheel.popDue(100000));
+  TEST_ASSERT_NULL(clock.wheel.popDue(100000));
+}
+
+static void test_remove() {
+  TimerNode nodes[2];
+  Clock clock(0);
+  clock.add(nodes[0], 100);
+  clock.add(nodes[1], 200);
+  clock.wheel.remove(&nodes[0]);
+  clock.wheel.remove(&nodes[0]);
+  TEST_ASSERT_FALSE(TimerWheel::linked(&nodes[0]));
+  TEST_ASSERT_EQUAL_UINT32(200, clock.wheel.untilNext(clock.now));
+
+  clock.wheel.remove(&nodes[1]);
+  TEST_ASSERT_EQUAL_UINT32(UINT32_MAX, clock.wheel.untilNext(clock.now));
+}
+
+static void test_add_and_cancel_during_dispatch() {
+  TimerNode periodic, cancelled, added;
+  Clock clock(0);
+  clock.add(periodic, 10);
+  clock.add(cancelled, 10);
+
+  TEST_ASSERT_TRUE(clock.advance());
+  TimerNode *node = clock.wheel.popDue(clock.now);
+  TEST_ASSERT_NOT_NULL(node);
+  // the first callback cancels the other one due at the same time and adds
+  // a new timer, both as a handler would from inside the dispatch
+  TimerNode *other = node == &periodic ? &cancelled : &periodic;
+  clock.wheel.remove(other);
+  clock.add(added, 0);
+  clock.add(*node, 10);
+
+  TEST_ASSERT_EQUAL_PTR(&added, clock.wheel.popDue(clock.now));
+  TEST_ASSERT_NULL(clock.wheel.popDue(clock.now));
+  TEST_ASSERT_FALSE(TimerWheel::linked(other));
+
+  TEST_ASSERT_TRUE(clock.advance());
+  TEST_ASSERT_EQUAL_UINT32(20, clock.now);
+  TEST_ASSERT_EQUAL_PTR(node, clock.wheel.popDue(clock.now));
+  TEST_ASSERT_FALSE(clock.advance());
+}
+
+static void test_readd_moves_node() {
+  TimerNode node;
+  Clock clock(0);
+  clock.add(node, 100000);
+  clock.add(node, 50);
+  TEST_ASSERT_EQUAL_UINT32(50, clock.wheel.untilNext(clock.now));
+  TEST_ASSERT_EQUAL_PTR(&node, clock.wheel.popDue(50));
+  TEST_ASSERT_NULL(clock.wheel.popDue(200000));
+}
+
+static void test_millis_wrap() {
+  TimerNode nodes[4];
+  Clock clock(0xFFFFFF00);
+  clock.add(nodes[0], 0xFF);
+  clock.add(nodes[1], 0x100);
+  clock.add(nodes[2], 0x101);
+  clock.add(nodes[3], 0x10000);
+
+  for (TimerNode &expected : nodes) {
+    TEST_ASSERT_TRUE(clock.advance());
+    TEST_ASSERT_EQUAL_UINT32(expected.due, clock.now);
+    TEST_ASSERT_EQUAL_PTR(&expected, clock.wheel.popDue(clock.now));
+  }
+  TEST_ASSERT_EQUAL_UINT32(0x0000FF00, clock.now);
+}
+
+static void randomRun(uint32_t start) {
+  std::vector<TimerNode> nodes(NODES);
+  Clock clock(start);
+  for (TimerNode &node : nodes) {
+    // mostly short timers, some for every level
+    uint32_t in = nextRandom(4) ? nextRandom(70000) : nextRandom(5000000);
+    clock.add(node, in);
+  }
+
+  uint32_t fired = 0;
+  while (fired < 20 * NODES && clock.advance()) {
+    TimerNode *node;
+    while ((node = clock.wheel.popDue(clock.now))) {
+      TEST_ASSERT_EQUAL_UINT32(node->due, clock.now);
+      fired++;
+      if (!nextRandom(3)) {
+        clock.add(*node, nextRandom(100000));
+      }
+      if (!nextRandom(5)) {
+        clock.wheel.remove(&nodes[nextRandom(NODES)]);
+      }
+    }
+  }
+
+  TEST_ASSERT_GREATER_THAN_UINT32(NODES, fired);
+}
+
+static void test_random_fake_clock() {
+  randomRun(0);
+  randomRun(12345);
+  // crosses the 32 bit millis() wrap with timers on every level
+  randomRun(0xFFFF0000);
+}
+
+int main() {
+  UNITY_BEGIN();
+  RUN_TEST(test_empty);
+  RUN_TEST(test_fires_on_time_across_levels);
+  RUN_TEST(test_not_early);
+  RUN_TEST(test_late_poll);
+  RUN_TEST(test_remove);
+  RUN_TEST(test_add_and_cancel_during_dispatch);
+  RUN_TEST(test_readd_moves_node);
+  RUN_TEST(test_millis_wrap);
+  RUN_TEST(test_random_fake_clock);
+  return UNITY_END();
+}
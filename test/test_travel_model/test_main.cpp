@@ -0,0 +1,126 @@
+#include "travel-model.h"
+#include <stdlib.h>
+#include <unity.h>
+
+#define RANGE 20000
+#define MOVES 5000
+
+void setUp() {}
+void tearDown() {}
+
+static uint32_t seed = 0x54524156;
+
+static uint32_t nextRandom(uint32_t limit) {
+  // xorshift, the runs are reproducible
+  seed ^= seed << 13;
+  seed ^= seed >> 17;
+  seed ^= seed << 5;
+  return seed % limit;
+}
+
+static int32_t clampPosition(int32_t position) {
+  return position < 0 ? 0 : position > RANGE ? RANGE : position;
+}
+
+static TravelModel segmentedModel() {
+  const uint32_t openMs[TRAVEL_SEGMENTS] = {4000, 5000, 6000, 7000};
+  const uint32_t closeMs[TRAVEL_SEGMENTS] = {3000, 4000, 5000, 6000};
+  TravelModel model;
+  model.setSegments(RANGE, openMs, closeMs);
+  return model;
+}
+
+static void test_linear_travel_time() {
+  TravelModel model;
+  model.setLinear(RANGE, 24000, 20000);
+  TEST_ASSERT_EQUAL_UINT32(24000, model.travelTime(Travel_Open));
+  TEST_ASSERT_EQUAL_UINT32(20000, model.travelTime(Travel_Close));
+  TEST_ASSERT_EQUAL_INT32(RANGE / 2,
+                          model.advance(0, Travel_Close, 10000));
+  TEST_ASSERT_EQUAL_INT32(RANGE / 2,
+                          model.advance(RANGE, Travel_Open, 12000));
+}
+
+static void test_segmented_travel_time() {
+  TravelModel model = segmentedModel();
+  TEST_ASSERT_EQUAL_UINT32(22000, model.travelTime(Travel_Open));
+  TEST_ASSERT_EQUAL_UINT32(18000, model.travelTime(Travel_Close));
+  // the end segments carry on past the range
+  TEST_ASSERT_EQUAL_INT32(RANGE + RANGE / 4,
+                          model.advance(RANGE, Travel_Close, 6000));
+  TEST_ASSERT_EQUAL_INT32(-RANGE / 4, model.advance(0, Travel_Open, 4000));
+}
+
+static void test_round_trip() {
+  TravelModel model = segmentedModel();
+  for (int i = 0; i < MOVES; i++) {
+    int32_t from = nextRandom(RANGE + 1);
+    int32_t to = nextRandom(RANGE + 1);
+    TravelDirection direction = to > from ? Travel_Close : Travel_Open;
+
+    // rounding loses at most one position per segment boundary crossed
+    int32_t reached = model.advance(from, direction, model.timeTo(from, to));
+    TEST_ASSERT_INT32_WITHIN(TRAVEL_SEGMENTS + 1, to, reached);
+  }
+}
+
+static void driftAndRehome(const TravelModel &model) {
+  TravelError error;
+  int32_t actual = 0, estimated = 0;
+  uint32_t rehomes = 0;
+
+  for (int i = 0; i < MOVES; i++) {
+    int32_t target = 1 + nextRandom(RANGE - 1);
+    if (error.needsRehome(RANGE)) {
+      // overdriven into the nearer end stop, both positions agree again
+      actual = estimated = estimated < RANGE / 2 ? 0 : RANGE;
+      error.homed();
+      rehomes++;
+      TEST_ASSERT_EQUAL_UINT32(0, error.estimate());
+    }
+    if (target == estimated) {
+      continue;
+    }
+
+    TravelDirection direction =
+        target > estimated ? Travel_Close : Travel_Open;
+    uint32_t ms = model.timeTo(estimated, target);
+
+    // the motor runs up to 1% off the model and starts up to 10 ms early or
+    // late, both within what the estimate allows for
+    int32_t jitter = (int32_t)nextRandom(21) - 10;
+    int32_t ran = (int64_t)ms * (99 + nextRandom(3)) / 100 + jitter;
+    actual = clampPosition(
+        model.advance(actual, direction, ran < 0 ? 0 : ran));
+    estimated = clampPosition(model.advance(estimated, direction, ms));
+    error.ran(ms);
+
+    uint32_t off = abs(actual - estimated);
+    TEST_ASSERT_LESS_OR_EQUAL_UINT32(error.estimate(), off);
+    // a partial move only starts below the threshold
+    TEST_ASSERT_LESS_OR_EQUAL_UINT32(RANGE / REHOME_RATIO +
+                                         TRAVEL_START_ERROR +
+                                         RANGE / TRAVEL_ERROR_RATIO,
+                                     error.estimate());
+  }
+
+  TEST_ASSERT_GREATER_THAN_UINT32(MOVES / 20, rehomes);
+}
+
+static void test_linear_drift() {
+  TravelModel model;
+  model.setLinear(RANGE, RANGE, RANGE);
+  driftAndRehome(model);
+}
+
+static void test_segmented_drift() { driftAndRehome(segmentedModel()); }
+
+int main() {
+  UNITY_BEGIN();
+  RUN_TEST(test_linear_travel_time);
+  RUN_TEST(test_segmented_travel_time);
+  RUN_TEST(test_round_trip);
+  RUN_TEST(test_linear_drift);
+  RUN_TEST(test_segmented_drift);
+  return UNITY_END();
+}
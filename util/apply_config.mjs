@@ -15,62 +15,22 @@ for (const configFile of configFiles) {
 
     const host = `${device}.lan`;
 
-    const deviceConfig = await fetch(`http://${host}/api/config`).then((r) =>
-      r.json()
-    );
-
+    // a merge patch keeps what the file doesn't mention, like the mqtt
+    // credentials, and the device applies it without a reboot
     config.mdns = { host: device };
-    if (deviceConfig.mqtt) {
-      config.mqtt = deviceConfig.mqtt;
-    } else {
-      //TODO: apply default
-      // config.mqtt = {
-      //   host: '',
-      //   user: '',
-      //   password: '',
-      // };
-    }
-
-    if (deepEqual(config, deviceConfig)) {
-      console.log("skip");
-      continue;
-    }
+    delete config.mqtt;
 
-    console.log("sending config");
-    const configBody = JSON.stringify(config);
-    const setResponse = await fetch(`http://${host}/api/config`, {
-      method: "POST",
-      body: configBody,
+    console.log("patching config");
+    const patchResponse = await fetch(`http://${host}/api/config`, {
+      method: "PATCH",
+      headers: { "Content-Type": "application/merge-patch+json" },
+      body: JSON.stringify(config),
     });
-    if (!setResponse.ok) {
-      throw new Error(`could not set config for ${device}`);
+    if (!patchResponse.ok) {
+      throw new Error(`could not patch config for ${device}`);
     }
-
-    await fetch(`http://${host}/api/reboot`, { method: "POST" });
   } catch (err) {
     console.error(err);
     continue;
   }
 }
-
-function deepEqual(x, y) {
-  if (x === y) {
-    return true;
-  }
-
-  if (typeof x == "object" && x != null && typeof y == "object" && y != null) {
-    if (Object.keys(x).length != Object.keys(y).length) return false;
-
-    for (var prop in x) {
-      if (y.hasOwnProperty(prop)) {
-        if (!deepEqual(x[prop], y[prop])) return false;
-      } else {
-        return false;
-      }
-    }
-
-    return true;
-  }
-
-  return false;
-}